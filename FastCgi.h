@@ -0,0 +1,803 @@
+#ifndef FASTCGI_BLOG_FASTCGI_H
+#define FASTCGI_BLOG_FASTCGI_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "RequestParams.h"
+#include "Output.h"
+
+// FastCGI responder on non-blocking sockets, see the FastCGI 1.0 specification.
+// Every thread runs its own epoll loop and handles the requests it reads on the loop thread.
+
+class Fcgi {
+
+public:
+
+    static constexpr uint8_t version = 1;
+    static constexpr size_t headerSize = 8;
+    static constexpr size_t maxContent = 65535;
+
+    enum Type : uint8_t {
+        BeginRequest = 1,
+        AbortRequest = 2,
+        EndRequest = 3,
+        Params = 4,
+        Stdin = 5,
+        Stdout = 6,
+        Stderr = 7,
+        Data = 8,
+        GetValues = 9,
+        GetValuesResult = 10,
+        UnknownType = 11
+    };
+
+    static constexpr uint16_t responder = 1;
+    static constexpr uint8_t keepConnection = 1;
+
+    enum ProtocolStatus : uint8_t {
+        RequestComplete = 0,
+        CantMultiplex = 1,
+        Overloaded = 2,
+        UnknownRole = 3
+    };
+
+    static void WriteHeader(char* header, uint8_t type, uint16_t id, size_t contentLength) {
+        header[0] = (char)version;
+        header[1] = (char)type;
+        header[2] = (char)(id >> 8);
+        header[3] = (char)id;
+        header[4] = (char)(contentLength >> 8);
+        header[5] = (char)contentLength;
+        header[6] = 0;
+        header[7] = 0;
+    }
+
+    // Name-value pair lengths take 1 byte below 128, 4 bytes otherwise
+    static void AppendLength(std::string& out, size_t length) {
+        if (length < 128) {
+            out += (char)length;
+            return;
+        }
+        out += (char)((length >> 24) | 0x80);
+        out += (char)(length >> 16);
+        out += (char)(length >> 8);
+        out += (char)length;
+    }
+
+    static void AppendPair(std::string& out, std::string_view name, std::string_view value) {
+        AppendLength(out, name.size());
+        AppendLength(out, value.size());
+        out += name;
+        out += value;
+    }
+
+    static bool ReadLength(std::string_view& s, size_t& length) {
+        if (s.empty())
+            return false;
+        auto b = (unsigned char)s[0];
+        if (b < 128) {
+            length = b;
+            s.remove_prefix(1);
+            return true;
+        }
+        if (s.size() < 4)
+            return false;
+        length = ((size_t)(b & 0x7f) << 24) | ((size_t)(unsigned char)s[1] << 16) |
+                 ((size_t)(unsigned char)s[2] << 8) | (unsigned char)s[3];
+        s.remove_prefix(4);
+        return true;
+    }
+
+    // Splits a name-value pair stream into views into it, false if it is malformed
+    static bool ParsePairs(std::string_view s, std::vector<std::pair<std::string_view, std::string_view>>& pairs) {
+        while (!s.empty()) {
+            size_t nameLength, valueLength;
+            if (!ReadLength(s, nameLength) || !ReadLength(s, valueLength) || nameLength + valueLength > s.size())
+                return false;
+            pairs.emplace_back(s.substr(0, nameLength), s.substr(nameLength, valueLength));
+            s.remove_prefix(nameLength + valueLength);
+        }
+        return true;
+    }
+
+};
+
+// Socket of a web server connection. Output is sent with scatter-gather writes,
+// what the socket does not take is queued until it is writable again.
+
+class FcgiConnection {
+
+public:
+
+    // Queued output over which the server stops reading requests from the connection
+    static constexpr size_t pendingLimit = 1 << 20;
+
+private:
+
+    int fd;
+    std::string pending;
+    size_t pendingSent = 0; // bytes at the front of pending already sent
+    bool failed = false;
+
+    // Sends as much as the socket takes and queues the rest, like writev() without SIGPIPE
+    void send(iovec* iov, size_t count) {
+
+        if (failed)
+            return;
+
+        size_t i = 0;
+        if (!hasPending()) {
+            while (i < count) {
+                msghdr msg{};
+                msg.msg_iov = iov + i;
+                msg.msg_iovlen = std::min<size_t>(count - i, IOV_MAX);
+                ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    failed = true;
+                    return;
+                }
+                if (n < 0)
+                    break;
+                auto sent = (size_t)n;
+                for (; i < count && sent >= iov[i].iov_len; i++)
+                    sent -= iov[i].iov_len;
+                if (sent) {
+                    iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + sent;
+                    iov[i].iov_len -= sent;
+                }
+            }
+        }
+
+        for (; i < count; i++)
+            pending.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+
+public:
+
+    explicit FcgiConnection(int fd) {
+        this->fd = fd;
+    }
+
+    FcgiConnection(const FcgiConnection&) = delete;
+    FcgiConnection& operator=(const FcgiConnection&) = delete;
+
+    ~FcgiConnection() {
+        close(fd);
+    }
+
+    int getFd() const {
+        return fd;
+    }
+
+    // Writes the parts as stream records of one request, an empty part ends the stream
+    void sendStream(uint8_t type, uint16_t id, const std::string_view* parts, size_t count) {
+
+        // Headers of up to 16 records per write
+        constexpr size_t batch = 16;
+        char headers[batch][Fcgi::headerSize];
+        iovec iov[batch * 2];
+        size_t records = 0;
+
+        auto add = [&](std::string_view content) {
+            Fcgi::WriteHeader(headers[records], type, id, content.size());
+            iov[records * 2] = {headers[records], Fcgi::headerSize};
+            iov[records * 2 + 1] = {const_cast<char*>(content.data()), content.size()};
+            if (++records == batch) {
+                send(iov, records * 2);
+                records = 0;
+            }
+        };
+
+        for (size_t p = 0; p < count; p++) {
+            std::string_view s = parts[p];
+            if (s.empty())
+                add(s);
+            for (; !s.empty(); s.remove_prefix(std::min(s.size(), Fcgi::maxContent)))
+                add(s.substr(0, Fcgi::maxContent));
+        }
+
+        if (records)
+            send(iov, records * 2);
+    }
+
+    void sendRecord(uint8_t type, uint16_t id, std::string_view content) {
+        sendStream(type, id, &content, 1);
+    }
+
+    // Sends queued output once the socket is writable, false if the connection is broken
+    bool flush() {
+        while (hasPending()) {
+            ssize_t n = ::send(fd, pending.data() + pendingSent, pending.size() - pendingSent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0)
+                failed = true;
+            else
+                pendingSent += (size_t)n;
+        }
+
+        // Sent bytes are dropped once all are, or once they are half of the buffer, so each byte is moved once at most
+        if (pendingSent == pending.size()) {
+            pending.clear();
+            pendingSent = 0;
+        }
+        else if (pendingSent > pending.size() / 2) {
+            pending.erase(0, pendingSent);
+            pendingSent = 0;
+        }
+        return !failed;
+    }
+
+    bool hasPending() const {
+        return pendingSent < pending.size() && !failed;
+    }
+
+    // True while the web server reads the output slower than requests produce it
+    bool isCongested() const {
+        return hasPending() && pending.size() - pendingSent > pendingLimit;
+    }
+
+    bool isFailed() const {
+        return failed;
+    }
+
+};
+
+// Request read from a connection, valid while the handler runs.
+// Params are views into the received PARAMS stream.
+
+class FcgiRequest : public RequestParams {
+
+    friend class FcgiServer;
+
+private:
+
+    FcgiConnection* connection;
+    uint16_t id;
+    bool keepConnection;
+    uint32_t appStatus = 0;
+    std::string paramsData;
+    std::vector<std::pair<std::string_view, std::string_view>> params;
+    std::string stdinData;
+
+public:
+
+    FcgiRequest(FcgiConnection* connection, uint16_t id, bool keepConnection) {
+        this->connection = connection;
+        this->id = id;
+        this->keepConnection = keepConnection;
+    }
+
+    std::string_view getParam(std::string_view name) const override {
+        for (const auto &param : params)
+            if (param.first == name)
+                return param.second;
+        return {};
+    }
+
+    const std::vector<std::pair<std::string_view, std::string_view>>& getParams() const {
+        return params;
+    }
+
+    const std::string& getStdin() const {
+        return stdinData;
+    }
+
+    uint16_t getId() const {
+        return id;
+    }
+
+    // Ends the response as broken when the handler returns: the end record carries the status
+    // and the connection is closed, so the web server does not take what was sent for a whole response
+    void fail(uint32_t status = 1) {
+        appStatus = status;
+    }
+
+    // Sends response data as it is, without copying it when the socket takes it
+    void write(std::string_view s) {
+        if (!s.empty())
+            connection->sendStream(Fcgi::Stdout, id, &s, 1);
+    }
+
+    void write(std::string_view head, std::string_view body) {
+        std::string_view parts[2];
+        size_t count = 0;
+        if (!head.empty())
+            parts[count++] = head;
+        if (!body.empty())
+            parts[count++] = body;
+        connection->sendStream(Fcgi::Stdout, id, parts, count);
+    }
+
+};
+
+// Accepts web server connections on a listening socket and calls the handler for every complete request.
+// The response is finished when the handler returns.
+// Complete requests wait in the queue of their loop, which reads its connections again between two requests it handles.
+// With a queue limit, requests over it get the overload handler as soon as they are read instead of waiting.
+
+class FcgiServer {
+
+public:
+
+    using Handler = std::function<void(FcgiRequest&)>;
+
+    // Events a loop takes from epoll at once
+    static constexpr int batchSize = 64;
+
+private:
+
+    struct Client {
+        FcgiConnection connection;
+        std::string input;
+        std::unordered_map<uint16_t, std::unique_ptr<FcgiRequest>> requests;
+        bool closing = false;
+        // Requests of the client waiting in the queue
+        size_t queued = 0;
+
+        explicit Client(int fd) : connection(fd) {
+        }
+    };
+
+    struct Queued {
+        Client* client;
+        std::unique_ptr<FcgiRequest> request;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    using Clients = std::unordered_map<int, std::unique_ptr<Client>>;
+
+    int listenFd;
+    int stopFd;
+    size_t loops;
+    Handler handler;
+    Handler overloaded;
+    size_t queueLimit = 0;
+    std::chrono::nanoseconds queueTimeout = std::chrono::nanoseconds::max();
+    std::atomic<uint64_t> rejected{0};
+
+    static void SetNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags >= 0)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    void endRequest(Client& client, uint16_t id, uint8_t protocolStatus, uint32_t appStatus = 0) {
+        char body[8] = {(char)(appStatus >> 24), (char)(appStatus >> 16), (char)(appStatus >> 8), (char)appStatus};
+        body[4] = (char)protocolStatus;
+        client.connection.sendRecord(Fcgi::EndRequest, id, std::string_view(body, sizeof(body)));
+    }
+
+    void getValues(Client& client, std::string_view content) {
+        std::vector<std::pair<std::string_view, std::string_view>> names;
+        Fcgi::ParsePairs(content, names);
+
+        std::string result;
+        for (const auto &name : names) {
+            if (name.first == "FCGI_MPXS_CONNS")
+                Fcgi::AppendPair(result, name.first, "1");
+            else if (name.first == "FCGI_MAX_CONNS" || name.first == "FCGI_MAX_REQS")
+                Fcgi::AppendPair(result, name.first, "65535");
+        }
+        client.connection.sendRecord(Fcgi::GetValuesResult, 0, result);
+    }
+
+    void finish(Client& client, const FcgiRequest& request) {
+        std::string_view end;
+        client.connection.sendStream(Fcgi::Stdout, request.id, &end, 1);
+        endRequest(client, request.id, Fcgi::RequestComplete, request.appStatus);
+
+        if (!request.keepConnection || request.appStatus)
+            client.closing = true;
+    }
+
+    // Answers the request with the overload handler, without handling it
+    void reject(Client& client, FcgiRequest& request) {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        if (overloaded)
+            overloaded(request);
+        finish(client, request);
+    }
+
+    // Queues a complete request, or answers it right away when the queue of the loop is full
+    void admit(Client& client, std::unique_ptr<FcgiRequest> request, std::deque<Queued>& queue,
+               std::chrono::steady_clock::time_point since) {
+        if (queueLimit && queue.size() >= queueLimit) {
+            reject(client, *request);
+            return;
+        }
+        client.queued++;
+        queue.push_back({&client, std::move(request), since});
+    }
+
+    // Handles the complete records of the input, false if the connection must be dropped
+    bool process(Client& client, std::deque<Queued>& queue, std::chrono::steady_clock::time_point since) {
+
+        size_t pos = 0;
+        std::string_view input = client.input;
+
+        while (input.size() - pos >= Fcgi::headerSize && !client.closing) {
+
+            auto header = reinterpret_cast<const unsigned char*>(input.data() + pos);
+            if (header[0] != Fcgi::version)
+                return false;
+            uint8_t type = header[1];
+            auto id = (uint16_t)(header[2] << 8 | header[3]);
+            size_t length = (size_t)header[4] << 8 | header[5];
+            size_t padding = header[6];
+            if (input.size() - pos < Fcgi::headerSize + length + padding)
+                break;
+
+            std::string_view content = input.substr(pos + Fcgi::headerSize, length);
+            pos += Fcgi::headerSize + length + padding;
+
+            if (id == 0) {
+                // Management records
+                if (type == Fcgi::GetValues)
+                    getValues(client, content);
+                else {
+                    char body[8] = {(char)type};
+                    client.connection.sendRecord(Fcgi::UnknownType, 0, std::string_view(body, sizeof(body)));
+                }
+                continue;
+            }
+
+            if (type == Fcgi::BeginRequest) {
+                if (content.size() < 8)
+                    return false;
+                auto role = (uint16_t)((unsigned char)content[0] << 8 | (unsigned char)content[1]);
+                bool keep = (unsigned char)content[2] & Fcgi::keepConnection;
+                if (role != Fcgi::responder) {
+                    endRequest(client, id, Fcgi::UnknownRole);
+                    if (!keep)
+                        client.closing = true;
+                    continue;
+                }
+                client.requests[id] = std::make_unique<FcgiRequest>(&client.connection, id, keep);
+                continue;
+            }
+
+            auto it = client.requests.find(id);
+            if (it == client.requests.end())
+                continue;
+            FcgiRequest& request = *it->second;
+
+            if (type == Fcgi::AbortRequest) {
+                bool keep = request.keepConnection;
+                client.requests.erase(it);
+                endRequest(client, id, Fcgi::RequestComplete);
+                if (!keep)
+                    client.closing = true;
+            }
+
+            else if (type == Fcgi::Params) {
+                if (!content.empty())
+                    request.paramsData.append(content);
+                else if (!Fcgi::ParsePairs(request.paramsData, request.params))
+                    return false;
+            }
+
+            else if (type == Fcgi::Stdin) {
+                if (!content.empty())
+                    request.stdinData.append(content);
+                else {
+                    auto ready = std::move(it->second);
+                    client.requests.erase(it);
+                    admit(client, std::move(ready), queue, since);
+                }
+            }
+        }
+
+        client.input.erase(0, pos);
+        return !client.connection.isFailed();
+    }
+
+    // Reads what the socket has, false if the connection is closed
+    bool read(Client& client) {
+        char buffer[65536];
+        while (true) {
+            ssize_t n = ::read(client.connection.getFd(), buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            if (n == 0)
+                return false;
+            client.input.append(buffer, (size_t)n);
+            if ((size_t)n < sizeof(buffer))
+                return true;
+        }
+    }
+
+    // Drops the client once it has nothing left to do, otherwise waits for what it needs next
+    void settle(int epollFd, Clients& clients, Client& client, bool alive, std::deque<Queued>& queue) {
+
+        int fd = client.connection.getFd();
+
+        if (alive && client.closing && !client.connection.hasPending() && !client.queued)
+            alive = false;
+
+        if (!alive) {
+            if (client.queued) {
+                queue.erase(std::remove_if(queue.begin(), queue.end(), [&](const Queued& q) {
+                    return q.client == &client;
+                }), queue.end());
+            }
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            clients.erase(fd);
+            return;
+        }
+
+        // Wait for the socket to be writable only while output is queued.
+        // Closing connections only send, and so do congested ones until their output drains below the limit.
+        epoll_event clientEvent{};
+        uint32_t pending = client.connection.hasPending() ? (uint32_t)EPOLLOUT : 0u;
+        bool sending = client.closing || client.connection.isCongested();
+        clientEvent.events = sending ? (uint32_t)EPOLLOUT : (uint32_t)(EPOLLIN | EPOLLRDHUP) | pending;
+        clientEvent.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &clientEvent);
+    }
+
+    // Accepts connections, sends queued output and reads requests into the queue
+    void handleEvent(int epollFd, Clients& clients, const epoll_event& event, std::deque<Queued>& queue,
+                     std::chrono::steady_clock::time_point since, bool& stopping) {
+
+        int fd = event.data.fd;
+
+        if (fd == stopFd) {
+            stopping = true;
+            return;
+        }
+
+        if (fd == listenFd) {
+            while (true) {
+                int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (clientFd < 0)
+                    break;
+                epoll_event clientEvent{};
+                clientEvent.events = EPOLLIN | EPOLLRDHUP;
+                clientEvent.data.fd = clientFd;
+                if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &clientEvent) != 0) {
+                    close(clientFd);
+                    continue;
+                }
+                clients[clientFd] = std::make_unique<Client>(clientFd);
+            }
+            return;
+        }
+
+        auto it = clients.find(fd);
+        if (it == clients.end())
+            return;
+        Client& client = *it->second;
+
+        bool alive = true;
+        if (event.events & EPOLLOUT)
+            alive = client.connection.flush();
+        if (alive && (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !client.closing &&
+            !client.connection.isCongested()) {
+            // Requests read before the web server closed its side are still answered
+            bool open = read(client);
+            alive = process(client, queue, since);
+            if (!open)
+                client.closing = true;
+        }
+        settle(epollFd, clients, client, alive, queue);
+    }
+
+    // Handles the oldest queued request, or turns it away when it waited too long:
+    // the web server has likely given up on it
+    void handleNext(int epollFd, Clients& clients, std::deque<Queued>& queue) {
+        Queued next = std::move(queue.front());
+        queue.pop_front();
+        Client& client = *next.client;
+        client.queued--;
+        if (!client.connection.isFailed()) {
+            if (std::chrono::steady_clock::now() - next.since > queueTimeout)
+                reject(client, *next.request);
+            else {
+                handler(*next.request);
+                finish(client, *next.request);
+            }
+        }
+        settle(epollFd, clients, client, !client.connection.isFailed(), queue);
+    }
+
+    void loop() {
+
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0)
+            return;
+
+        // Every loop waits on the listening socket, one of them is woken per connection
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.events = EPOLLIN;
+        event.data.fd = stopFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+
+        Clients clients;
+        std::deque<Queued> queue;
+        epoll_event events[batchSize];
+        bool stopping = false;
+
+        while (!stopping) {
+
+            // Blocks only while nothing is queued, otherwise takes what is ready between two requests
+            int n = epoll_wait(epollFd, events, batchSize, queue.empty() ? -1 : 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+
+            // Queue time counts from here, before it a request waited for one request to be handled at most
+            auto since = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; i++)
+                handleEvent(epollFd, clients, events[i], queue, since, stopping);
+
+            // One request per round, those arriving while it renders are read in the next one
+            // and turned away at once when the queue is full
+            if (!queue.empty())
+                handleNext(epollFd, clients, queue);
+        }
+
+        // Requests read before stop() are still answered
+        while (!queue.empty())
+            handleNext(epollFd, clients, queue);
+
+        clients.clear();
+        close(epollFd);
+    }
+
+public:
+
+    // 0 loops means one per core
+    FcgiServer(int listenFd, size_t loops, Handler handler) {
+        this->listenFd = listenFd;
+        this->loops = loops ? loops : std::max(1u, std::thread::hardware_concurrency());
+        this->handler = std::move(handler);
+        this->stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        SetNonBlocking(listenFd);
+    }
+
+    FcgiServer(const FcgiServer&) = delete;
+    FcgiServer& operator=(const FcgiServer&) = delete;
+
+    ~FcgiServer() {
+        close(stopFd);
+    }
+
+    // At most limit requests wait to be handled in every loop, 0 for no limit, and none waits longer than timeout.
+    // The others go to the overload handler, which answers them without rendering. Set before run().
+    void setQueueLimit(size_t limit, std::chrono::nanoseconds timeout, Handler overloaded) {
+        this->queueLimit = limit;
+        this->queueTimeout = timeout;
+        this->overloaded = std::move(overloaded);
+    }
+
+    uint64_t getRejected() const {
+        return rejected.load(std::memory_order_relaxed);
+    }
+
+    // Serves requests until stop() is called
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < loops; i++)
+            threads.emplace_back(&FcgiServer::loop, this);
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    // Makes every loop return after the events it is handling, safe to call from any thread
+    void stop() {
+        uint64_t one = 1;
+        ssize_t r = ::write(stopFd, &one, sizeof(one));
+        (void)r;
+    }
+
+    // Listening socket on "path" for a Unix socket or "[host]:port" for TCP, -1 on failure
+    static int Listen(const std::string& address, int backlog) {
+
+        int fd;
+        size_t colon = address.rfind(':');
+
+        if (colon != std::string::npos && address.find('/') == std::string::npos) {
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo* info = nullptr;
+            std::string host = address.substr(0, colon);
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), address.c_str() + colon + 1, &hints, &info) != 0)
+                return -1;
+            fd = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (fd >= 0)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (fd >= 0 && bind(fd, info->ai_addr, info->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(info);
+        }
+
+        else {
+            sockaddr_un addr{};
+            if (address.size() >= sizeof(addr.sun_path))
+                return -1;
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, address.c_str(), address.size());
+            unlink(address.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        if (fd >= 0 && listen(fd, backlog) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+};
+
+// Streams the page into a FastCGI request
+
+class FcgiOutput : public Output {
+
+private:
+
+    FcgiRequest* request;
+
+protected:
+
+    void write(std::string_view chunk) override {
+        request->write(chunk);
+    }
+
+public:
+
+    explicit FcgiOutput(size_t chunkSize) : Output(chunkSize) {
+        this->request = nullptr;
+    }
+
+    void setRequest(FcgiRequest* request) {
+        clear();
+        this->request = request;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_FASTCGI_H
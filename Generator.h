@@ -6,198 +6,496 @@
 #define FASTCGI_BLOG_GENERATOR_H
 
 #include <regex>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 
-#include "fcgio.h"
-
+#include "RequestParams.h"
 #include "Tree.h"
+#include "Output.h"
+#include "Metrics.h"
+
+// Limits of one render, it stops at the first one reached
+
+struct RenderBudget {
+    std::chrono::nanoseconds time = std::chrono::nanoseconds::max();
+    size_t bytes = SIZE_MAX;
+    // Templates nested into each other, a template printing itself ends here
+    size_t depth = 64;
+};
 
 class Generator {
 
+public:
+
+    // Collected while rendering
+    struct RenderInfo {
+        // The output depends on FCGI request variables and must not be reused for other requests
+        bool requestDependent = false;
+        // The render ran out of its budget and the output is incomplete
+        bool aborted = false;
+    };
+
 private:
 
-    static std::string ProcessVariable(Node* currentPage, Node* templatePage, const std::string& templateName, FCGX_Request* request,
-                                const std::string& templatesPath, std::string variableName) {
+    // Scratch strings of the rendering thread, they keep their memory from page to page
+    struct Buffers {
+        std::string path;
+        std::string value;
+        std::string query;
+    };
+
+    // What the template being rendered read besides its template and data nodes
+    enum Dependency : unsigned {
+        ReadsPage = 1,
+        ReadsRequest = 2
+    };
+
+    struct RenderContext {
+        TemplateCache& templates;
+        FragmentCache* fragments;
+        SortedIndexes& sorted;
+        const Tree* tree;
+        const RequestParams* request;
+        const std::string& templatesPath;
+        RenderInfo& info;
+        Metrics* metrics;
+        Buffers& buffers;
+        const RenderBudget& budget;
+        std::chrono::steady_clock::time_point deadline;
+        unsigned dependencies = 0;
+        size_t depth = 0;
+        size_t bytes = 0;
+        uint32_t steps = 0;
+    };
+
+    static Buffers& GetBuffers() {
+        thread_local Buffers buffers;
+        return buffers;
+    }
 
-        if (variableName[0] != '$')
-            return "";
+    static std::chrono::steady_clock::time_point GetDeadline(const RenderBudget& budget) {
+        auto now = std::chrono::steady_clock::now();
+        if (budget.time >= std::chrono::steady_clock::time_point::max() - now)
+            return std::chrono::steady_clock::time_point::max();
+        return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(budget.time);
+    }
 
-        variableName = variableName.substr(1);
+    // True once the render is over its budget, the clock is read every few steps
+    static bool OverBudget(RenderContext& context) {
+        if (context.info.aborted)
+            return true;
+        if (context.bytes > context.budget.bytes ||
+            ((++context.steps & 63) == 0 && context.deadline != std::chrono::steady_clock::time_point::max() &&
+             std::chrono::steady_clock::now() >= context.deadline))
+            context.info.aborted = true;
+        return context.info.aborted;
+    }
+
+    static void Append(RenderContext& context, Output& out, std::string_view s) {
+        context.bytes += s.size();
+        out.append(s);
+    }
+
+    // Writes the value of a '$VARIABLE' into value
+    static void ProcessVariable(RenderContext& context, Node* currentPage, Node* templatePage,
+                                const std::string& variable, std::string& value) {
+
+        value.clear();
+
+        if (variable[0] != '$')
+            return;
+
+        std::string_view variableName = std::string_view(variable).substr(1);
 
         // PATH
 
         if (variableName == "@FULLPATH" || variableName == "FULLPATH" || variableName == "PATH" || variableName == "@PATH") {
 
             Node* p = templatePage;
-            if (variableName[0] == '@')
+            if (variableName[0] == '@') {
                 p = currentPage;
+                context.dependencies |= ReadsPage;
+            }
 
-            std::string nodePath;
+            std::string& nodePath = context.buffers.path;
+            nodePath.clear();
             if (variableName == "PATH" || variableName == "@PATH")
                 nodePath = p->getKey();
             else
-                nodePath = p->getPath();
-
-            auto splitPath = Utils::Split(nodePath, '/');
-            std::string resultPath;
-            for (const auto &path : splitPath)
-                resultPath.append(path.substr(0, path.find_first_of('.')) + '/');
+                p->appendPath(nodePath);
 
-            if (resultPath.empty())
-                return "";
+            for (auto path : Utils::SplitView(nodePath, '/')) {
+                value.append(path.substr(0, path.find('.')));
+                value += '/';
+            }
 
-            return resultPath.substr(0, resultPath.length() - 1);
+            if (!value.empty())
+                value.pop_back();
+            return;
         }
 
-        // FCGI variables
+        // FCGI variables, the page depends on the request even when rendered without one
 
-        else if (request) {
-#ifndef tests
-            return FCGX_GetParam(variableName.c_str(), request->envp);
-#endif
-        }
+        context.info.requestDependent = true;
+        context.dependencies |= ReadsRequest;
 
-        return "";
+        if (context.request)
+            value = context.request->getParam(variableName);
 
     }
 
-public:
+    static size_t GetCount(RenderContext& context, Node* currentPage, Node* templatePage, const Template::Count& count,
+                           size_t fallback) {
+        if (count.variable.empty())
+            return count.value;
+        ProcessVariable(context, currentPage, templatePage, count.variable, context.buffers.value);
+        if (context.buffers.value.empty())
+            return fallback;
+        long long value = strtoll(context.buffers.value.c_str(), nullptr, 10);
+        return value > 0 ? (size_t)value : 0;
+    }
 
-    static std::string Generate(Node* currentPage, Node* templatePage, const std::string& templateName, FCGX_Request* request,
-                                const std::string& templatesPath) {
+    // Calls f for the nodes of a print with sort, limit, offset or page arguments.
+    // Children of a single parent are taken from its sorted index, nodes of many parents are sorted on every call.
+    template <typename F>
+    static void ForEachSorted(RenderContext& context, Node* currentPage, Node* templatePage, Node* p,
+                              const Template::Instruction& instruction, F& f) {
+
+        size_t limit = GetCount(context, currentPage, templatePage, instruction.limit, SIZE_MAX);
+        size_t offset = GetCount(context, currentPage, templatePage, instruction.offset, 0);
+        size_t page = GetCount(context, currentPage, templatePage, instruction.page, 0);
+        if (page > 1 && limit != SIZE_MAX)
+            offset = page - 1 > (SIZE_MAX - offset) / std::max<size_t>(limit, 1) ? SIZE_MAX : offset + (page - 1) * limit;
+        if (!limit)
+            return;
+
+        auto visit = [&](Node* n) {
+            if (offset) {
+                offset--;
+                return true;
+            }
+            return f(n) && --limit > 0;
+        };
+
+        // The last segment matches the children of the parent the rest of the path leads to
+        std::string_view path = instruction.path;
+        size_t slash = path.rfind('/');
+        std::string_view segment = slash == std::string_view::npos ? path : path.substr(slash + 1);
+        Node* parent = nullptr;
+        if (slash == std::string_view::npos)
+            parent = p;
+        else if (slash == 0)
+            parent = p->getRoot();
+        else {
+            size_t parents = 0;
+            p->forEach(path.substr(0, slash), [&](Node* n) {
+                parent = n;
+                return ++parents < 2;
+            });
+            if (parents != 1)
+                parent = nullptr;
+        }
 
-        Node* root = currentPage->getRoot();
-        Node* templateNode = root->getFirst(templatesPath + '/' + templateName);
+        if (parent && !segment.empty()) {
+            auto regex = Utils::IsLiteral(segment, ".") ? nullptr : Utils::GetRegex(segment);
+            const std::vector<uint32_t>* order = instruction.sortKey.empty() ? nullptr :
+                                                 &context.sorted.get(parent, instruction.sortKey, instruction.descending);
+            for (size_t i = 0; i < parent->getChildCount(); i++) {
+                Node* child = parent->getChild(order ? (*order)[i] : i);
+                if (child->matches(segment, regex.get()) && !visit(child))
+                    return;
+            }
+            return;
+        }
 
-        if (!templateNode)
-            return "";
+        std::vector<Node*> nodes = p->get(path);
+        if (!instruction.sortKey.empty())
+            SortedIndexes::Sort(nodes, instruction.sortKey, instruction.descending);
+        for (Node* n : nodes)
+            if (!visit(n))
+                return;
+    }
 
-        std::string t = templateNode->getValue();
-        std::string result;
+    static void RenderTemplate(RenderContext& context, Node* currentPage, Node* templatePage, const Template& t,
+                               Output& out) {
 
-        static const std::regex tagRegex(R"(\<\!\-\-\s*(\w+)\((.*?)\)\s*\-\-\>)");
-        std::smatch m;
-        std::string function;
-        std::vector<std::string> params;
-        std::string::const_iterator searchStart(t.cbegin());
-        unsigned long lastPartPos = 0;
+        Node* root = currentPage->getRoot();
         bool printing = true;
 
-        while (regex_search(searchStart, t.cend(), m, tagRegex)) {
-            function = m[1];
-            params = Utils::Tokenize(m[2]);
+        for (const auto &instruction : t.getInstructions()) {
+
+            if (OverBudget(context))
+                return;
 
-            if (printing)
-                result.append(t.substr(lastPartPos, m.position()));
+            if (instruction.function == Template::Function::EndIf) {
+                printing = true;
+                continue;
+            }
 
-            lastPartPos += m.position() + m.length();
+            if (!printing)
+                continue;
 
-            if (function == "print" && !params.empty() && printing) {
+            if (instruction.function == Template::Function::Text)
+                Append(context, out, instruction.text);
 
-                if (params[0][0] == '$')
-                    result.append(ProcessVariable(currentPage, templatePage, templateName, request,
-                                                  templatesPath, params[0]));
+            else if (instruction.function == Template::Function::Print) {
+
+                if (!instruction.variable.empty()) {
+                    ProcessVariable(context, currentPage, templatePage, instruction.variable, context.buffers.value);
+                    Append(context, out, context.buffers.value);
+                }
 
                 else {
                     // Node value or generated template
 
-                    Node* p = templatePage;
-                    if (params[0][0] == '@') {
-                        params[0] = params[0].substr(1);
-                        p = currentPage;
-                    }
-                    std::string subTemplateName;
-                    if (params.size() > 1)
-                        subTemplateName = params[1];
+                    Node* p = instruction.current ? currentPage : templatePage;
+                    if (instruction.current)
+                        context.dependencies |= ReadsPage;
+                    std::string_view subTemplateName = instruction.subTemplateName;
 
                     // Print multiple nodes
-                    auto nodes = p->get(params[0]);
+                    auto print = [&](Node* n) {
 
-                    for (const auto &n : nodes) {
+                        if (OverBudget(context))
+                            return false;
 
                         if (subTemplateName.empty()) {
-                            // Try the template of the node
-                            auto splitKey = Utils::Split(n->getKey(), '.');
-                            if (splitKey.size() > 1)
-                                subTemplateName = splitKey[1];
+                            // Try the template of the node, the second part of its key
+                            auto key = n->getKey();
+                            size_t dot = key.find('.');
+                            if (dot != std::string_view::npos) {
+                                subTemplateName = key.substr(dot + 1);
+                                subTemplateName = subTemplateName.substr(0, subTemplateName.find('.'));
+                            }
                             // Check the template of the node exists
                             if (!root->getFirst(subTemplateName))
-                                subTemplateName = "";
+                                subTemplateName = {};
                         }
 
                         if (!subTemplateName.empty())
-                            result.append(Generate(currentPage, n, subTemplateName, request, templatesPath));
+                            Render(context, currentPage, n, subTemplateName, out);
                         else
-                            result.append(n->getValue());
+                            Append(context, out, n->getValue());
 
-                    }
+                        return true;
+                    };
+
+                    if (instruction.sliced)
+                        ForEachSorted(context, currentPage, templatePage, p, instruction, print);
+                    else
+                        p->forEach(instruction.path, print);
                 }
 
             }
 
-            else if (function == "template" && !params.empty() && printing) {
-
-                auto pages = Utils::Split(currentPage->getPath(), '/');
+            else if (instruction.function == Template::Function::Template) {
+
+                context.dependencies |= ReadsPage;
+
+                // Ancestors of the page from the top, excluding the root
+                size_t depth = 0;
+                for (Node* n = currentPage; n->getParent(); n = n->getParent())
+                    depth++;
+
+                for (const auto &subTemplateName : instruction.templateNames) {
+                    Node* page = nullptr;
+                    for (size_t level = depth; level > 0 && !page; level--) {
+                        Node* n = currentPage;
+                        for (size_t i = 1; i < level; i++)
+                            n = n->getParent();
+                        for (auto part : Utils::SplitView(n->getKey(), '.'))
+                            if (part == subTemplateName) {
+                                page = n;
+                                break;
+                            }
+                    }
 
-                for (const auto &subTemplateName : params) {
-                    std::string pagePath;
-                    bool pageFound = false;
-                    for (const auto &page : pages) {
-                        pagePath += '/' + page;
-                        auto pagePathSplit = Utils::Split(page, '.');
-                        if (std::find(pagePathSplit.begin(), pagePathSplit.end(), subTemplateName) != pagePathSplit.end()) {
-                            pageFound = true;
-                            break;
-                        }
+                    if (page) {
+                        std::string& pagePath = context.buffers.path;
+                        pagePath.assign("/");
+                        page->appendPath(pagePath);
+                        Render(context, currentPage, root->getFirst(pagePath), subTemplateName, out);
                     }
+                }
+
+            }
 
-                    if (pageFound) {
-                        auto n = root->getFirst(pagePath);
-                        std::string subTemplate = Generate(currentPage, n, subTemplateName, request, templatesPath);
+            else if (instruction.function == Template::Function::Search) {
 
-                        result.append(subTemplate);
+                // There is no index without a tree
+                if (!context.tree)
+                    continue;
+
+                size_t limit = GetCount(context, currentPage, templatePage, instruction.limit, 10);
+                std::string_view query = instruction.query;
+                if (!instruction.variable.empty()) {
+                    ProcessVariable(context, currentPage, templatePage, instruction.variable, context.buffers.value);
+                    query = context.buffers.value;
+                    if (query.find('=') != std::string_view::npos) {
+                        Utils::UrlDecode(Utils::GetQueryParam(query, "q"), context.buffers.query);
+                        query = context.buffers.query;
                     }
                 }
 
-            }
+                // Results of nested searches must not replace these
+                std::vector<Node*> results;
+                context.tree->search(query, limit, results);
+                for (Node* n : results) {
+                    if (OverBudget(context))
+                        break;
+                    Render(context, currentPage, n, instruction.subTemplateName, out);
+                }
 
-            else if (function == "if" && params.size() == 2 && printing) {
+            }
 
-                std::regex r(params[1]);
+            else if (instruction.function == Template::Function::If) {
 
-                std::string variable = params[0];
-                std::string value;
-                if (variable[0] == '$')
-                    value = ProcessVariable(currentPage, templatePage, templateName, request, templatesPath, variable);
+                std::string_view value;
+                if (!instruction.variable.empty()) {
+                    ProcessVariable(context, currentPage, templatePage, instruction.variable, context.buffers.value);
+                    value = context.buffers.value;
+                }
                 else {
-                    Node* p = templatePage;
-                    if (variable[0] == '@') {
-                        variable = variable.substr(1);
-                        p = currentPage;
-                    }
-                    Node* n = p->getFirst(variable);
+                    Node* p = instruction.current ? currentPage : templatePage;
+                    if (instruction.current)
+                        context.dependencies |= ReadsPage;
+                    Node* n = p->getFirst(instruction.path);
                     if (n)
                         value = n->getValue();
                 }
 
-                if (!std::regex_match(value, r))
+                if (!instruction.condition || !std::regex_match(value.begin(), value.end(), *instruction.condition))
                     printing = false;
 
             }
 
-            else if (function == "endif") {
-                printing = true;
+        }
+
+    }
+
+    static void Render(RenderContext& context, Node* currentPage, Node* templatePage, std::string_view templateName,
+                       Output& out) {
+
+        std::string& templatePath = context.buffers.path;
+        templatePath.assign(context.templatesPath);
+        templatePath += '/';
+        templatePath.append(templateName);
+        Node* templateNode = currentPage->getRoot()->getFirst(templatePath);
+
+        if (!templateNode)
+            return;
+
+        if (context.depth >= context.budget.depth) {
+            context.info.aborted = true;
+            return;
+        }
+
+        auto start = context.metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+        // Lazy sources are read from the content store only to compile them
+        const auto& entry = context.templates.get(templateNode, [templateNode]() {
+            return templateNode->getValue();
+        }, [&](TemplateCache::Entry& e) {
+            if (context.metrics) {
+                e.metricsOwner = context.metrics;
+                e.metrics = &context.metrics->getTemplate(templateName);
             }
+        });
+        const Template& t = *entry.compiled;
 
-            else if (printing)
-                result.append(m.str());
+        // Dependencies of this template and the ones nested into it, added to the outer template afterwards
+        unsigned outer = context.dependencies;
+        context.dependencies = 0;
 
-            searchStart = m.suffix().first;
+        // The page itself is streamed, whole responses are cached elsewhere
+        FragmentCache* fragments = context.depth > 0 ? context.fragments : nullptr;
+        auto result = FragmentCache::Result::Miss;
+        context.depth++;
+
+        if (!fragments)
+            RenderTemplate(context, currentPage, templatePage, t, out);
+
+        else if (auto fragment = fragments->get(templateNode, templatePage); fragment && fragment->cacheable) {
+            Append(context, out, fragment->text);
+            result = FragmentCache::Result::Hit;
+        }
+
+        else if (fragment || fragments->isFull()) {
+            // Known to be uncacheable or no room to keep it
+            RenderTemplate(context, currentPage, templatePage, t, out);
+            result = context.dependencies ? FragmentCache::Result::Uncacheable : FragmentCache::Result::Miss;
+        }
+
+        else {
+            // First render, kept aside until it is known whether it can be reused
+            Output rendered;
+            RenderTemplate(context, currentPage, templatePage, t, rendered);
+            result = context.dependencies ? FragmentCache::Result::Uncacheable : FragmentCache::Result::Miss;
+            // A render cut short is not the fragment
+            if (!context.info.aborted)
+                fragments->put(templateNode, templatePage, !context.dependencies, rendered.getBuffer());
+            out.append(rendered.getBuffer());
+        }
+
+        context.depth--;
+        context.dependencies |= outer;
+
+        if (fragments)
+            fragments->count(result);
+
+        if (context.metrics) {
+            // Looked up by name only when rendered with other metrics than the template was compiled with
+            TemplateMetrics& m = entry.metricsOwner == context.metrics ? *entry.metrics : context.metrics->getTemplate(templateName);
+            m.time.record(start);
+            if (fragments)
+                (result == FragmentCache::Result::Hit ? m.fragmentHits :
+                 result == FragmentCache::Result::Miss ? m.fragmentMisses : m.fragmentUncacheable)
+                        .fetch_add(1, std::memory_order_relaxed);
         }
 
-        if (printing)
-            result.append(t.substr(lastPartPos));
+    }
+
+public:
+
+    static std::string Generate(Node* currentPage, Node* templatePage, const std::string& templateName, const RequestParams* request,
+                                const std::string& templatesPath, RenderInfo* info = nullptr) {
+
+        // Templates are compiled and children sorted once per call when there is no tree to keep them in
+        TemplateCache templates;
+        SortedIndexes sorted;
+        RenderInfo localInfo;
+        RenderBudget budget;
+        RenderContext context{templates, nullptr, sorted, nullptr, request, templatesPath, info ? *info : localInfo, nullptr, GetBuffers(),
+                              budget, GetDeadline(budget)};
+        Output out;
+        ContentStore::Scope scope;
+        Render(context, currentPage, templatePage, templateName, out);
+        return std::move(out.getBuffer());
+
+    }
+
+    static std::string Generate(Tree& tree, Node* currentPage, Node* templatePage, const std::string& templateName,
+                                const RequestParams* request, const std::string& templatesPath, RenderInfo* info = nullptr) {
+
+        Output out;
+        Generate(tree, currentPage, templatePage, templateName, request, templatesPath, out, info);
+        return std::move(out.getBuffer());
+
+    }
 
-        return result;
+    // Renders into the output, the caller flushes it. Template render times go to metrics if given.
+    // A render over its budget stops where it is and sets aborted in info.
+    static void Generate(Tree& tree, Node* currentPage, Node* templatePage, const std::string& templateName,
+                         const RequestParams* request, const std::string& templatesPath, Output& out, RenderInfo* info = nullptr,
+                         Metrics* metrics = nullptr, const RenderBudget& budget = RenderBudget()) {
+
+        RenderInfo localInfo;
+        RenderContext context{tree.getTemplates(), &tree.getFragments(), tree.getSorted(), &tree, request, templatesPath, info ? *info : localInfo,
+                              metrics, GetBuffers(), budget, GetDeadline(budget)};
+        // Lazily loaded values stay in memory until the page is rendered
+        ContentStore::Scope scope;
+        Render(context, currentPage, templatePage, templateName, out);
 
     }
 
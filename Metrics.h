@@ -0,0 +1,247 @@
+#ifndef FASTCGI_BLOG_METRICS_H
+#define FASTCGI_BLOG_METRICS_H
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <shared_mutex>
+#include <mutex>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+// Latency histogram with log-linear buckets: 4 buckets per power of two,
+// so every bucket is within 25% of the values it holds. Recording is lock-free.
+
+class Histogram {
+
+private:
+
+    static constexpr int subBuckets = 4;
+    static constexpr int bucketCount = 64 * subBuckets;
+
+    // Exported bucket bounds, from about 1us to 68s
+    static constexpr int firstExported = 9 * subBuckets;
+    static constexpr int lastExported = 35 * subBuckets - 1;
+
+    std::atomic<uint64_t> buckets[bucketCount] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+
+    static int bucketIndex(uint64_t value) {
+        if (value < subBuckets)
+            return (int)value;
+        int exponent = 63 - __builtin_clzll(value);
+        int mantissa = (int)(value >> (exponent - 2)) & (subBuckets - 1);
+        return (exponent - 1) * subBuckets + mantissa;
+    }
+
+    // Largest value of the bucket
+    static uint64_t bucketMax(int i) {
+        if (i < subBuckets)
+            return i;
+        int exponent = i / subBuckets + 1;
+        uint64_t mantissa = i % subBuckets;
+        return ((subBuckets + mantissa + 1) << (exponent - 2)) - 1;
+    }
+
+public:
+
+    // Values are nanoseconds
+    void record(uint64_t value) {
+        buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    uint64_t getCount() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getSum() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the given percentile, 0 when empty
+    uint64_t getPercentile(double percentile) const {
+        uint64_t total = getCount();
+        if (!total)
+            return 0;
+        auto rank = (uint64_t)((double)total * percentile / 100.0 + 0.5);
+        if (rank < 1)
+            rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < bucketCount; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return bucketMax(i);
+        }
+        return bucketMax(bucketCount - 1);
+    }
+
+    // Prometheus histogram lines in seconds, labels are inserted into every sample
+    void format(std::string& out, const std::string& name, const std::string& labels) const {
+
+        char number[32];
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        uint64_t cumulative = 0;
+
+        for (int i = 0; i <= lastExported; i++) {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            if (i < firstExported)
+                continue;
+            snprintf(number, sizeof(number), "%.9f", (double)bucketMax(i) / 1e9);
+            out += name + "_bucket{" + prefix + "le=\"" + number + "\"} " + std::to_string(cumulative) + "\n";
+        }
+
+        // Sum and count are read after the buckets, so +Inf never falls below the last bucket
+        uint64_t total = getCount();
+        snprintf(number, sizeof(number), "%.9f", (double)getSum() / 1e9);
+        out += name + "_bucket{" + prefix + "le=\"+Inf\"} " + std::to_string(std::max(total, cumulative)) + "\n";
+        out += name + "_sum" + (labels.empty() ? "" : "{" + labels + "}") + " " + number + "\n";
+        out += name + "_count" + (labels.empty() ? "" : "{" + labels + "}") + " " + std::to_string(std::max(total, cumulative)) + "\n";
+    }
+
+};
+
+// Render time of a template including the templates nested into it,
+// and how its renders went through the fragment cache
+
+struct TemplateMetrics {
+    Histogram time;
+    std::atomic<uint64_t> fragmentHits{0};
+    std::atomic<uint64_t> fragmentMisses{0};
+    std::atomic<uint64_t> fragmentUncacheable{0};
+};
+
+// Server metrics in Prometheus text format
+
+class Metrics {
+
+private:
+
+    static constexpr int maxStatus = 600;
+
+    std::atomic<uint64_t> responses[maxStatus] = {};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> abortedRenders{0};
+
+    // Never removed, so references handed out stay valid
+    std::map<std::string, std::unique_ptr<TemplateMetrics>, std::less<>> templates;
+    mutable std::shared_mutex templatesMutex;
+
+    static std::string escape(const std::string& s) {
+        std::string result;
+        for (char c : s) {
+            if (c == '\\' || c == '"')
+                result += '\\';
+            if (c == '\n')
+                result += "\\n";
+            else
+                result += c;
+        }
+        return result;
+    }
+
+public:
+
+    Histogram requestTime;
+    Histogram lookupTime;
+
+    void countResponse(int status, size_t size) {
+        if (status >= 0 && status < maxStatus)
+            responses[status].fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    uint64_t getResponses(int status) const {
+        return status >= 0 && status < maxStatus ? responses[status].load(std::memory_order_relaxed) : 0;
+    }
+
+    uint64_t getBytes() const {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+    // Renders stopped by their budget
+    void countAbortedRender() {
+        abortedRenders.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t getAbortedRenders() const {
+        return abortedRenders.load(std::memory_order_relaxed);
+    }
+
+    // Looked up under a lock, renders keep the result next to their compiled template
+    TemplateMetrics& getTemplate(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(templatesMutex);
+            auto it = templates.find(name);
+            if (it != templates.end())
+                return *it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(templatesMutex);
+        auto it = templates.find(name);
+        if (it == templates.end())
+            it = templates.emplace(std::string(name), std::make_unique<TemplateMetrics>()).first;
+        return *it->second;
+    }
+
+    Histogram& getTemplateTime(std::string_view name) {
+        return getTemplate(name).time;
+    }
+
+    std::string format() const {
+
+        std::string out;
+
+        out += "# TYPE fblog_responses_total counter\n";
+        for (int status = 0; status < maxStatus; status++) {
+            uint64_t n = getResponses(status);
+            if (n)
+                out += "fblog_responses_total{status=\"" + std::to_string(status) + "\"} " + std::to_string(n) + "\n";
+        }
+
+        out += "# TYPE fblog_response_bytes_total counter\n";
+        out += "fblog_response_bytes_total " + std::to_string(getBytes()) + "\n";
+
+        out += "# TYPE fblog_render_aborted_total counter\n";
+        out += "fblog_render_aborted_total " + std::to_string(getAbortedRenders()) + "\n";
+
+        out += "# TYPE fblog_request_duration_seconds histogram\n";
+        requestTime.format(out, "fblog_request_duration_seconds", "");
+
+        out += "# TYPE fblog_lookup_duration_seconds histogram\n";
+        lookupTime.format(out, "fblog_lookup_duration_seconds", "");
+
+        out += "# TYPE fblog_template_duration_seconds histogram\n";
+        std::shared_lock<std::shared_mutex> lock(templatesMutex);
+        for (const auto &t : templates)
+            t.second->time.format(out, "fblog_template_duration_seconds", "template=\"" + escape(t.first) + "\"");
+
+        // Templates with many uncacheable renders read the current page or the request
+        out += "# TYPE fblog_fragment_cache_total counter\n";
+        for (const auto &t : templates) {
+            std::string labels = "{template=\"" + escape(t.first) + "\",result=\"";
+            std::pair<const char*, uint64_t> results[] = {
+                    {"hit", t.second->fragmentHits.load(std::memory_order_relaxed)},
+                    {"miss", t.second->fragmentMisses.load(std::memory_order_relaxed)},
+                    {"uncacheable", t.second->fragmentUncacheable.load(std::memory_order_relaxed)}};
+            for (const auto &result : results)
+                if (result.second)
+                    out += "fblog_fragment_cache_total" + labels + result.first + "\"} " + std::to_string(result.second) + "\n";
+        }
+
+        return out;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_METRICS_H
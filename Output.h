@@ -0,0 +1,66 @@
+#ifndef FASTCGI_BLOG_OUTPUT_H
+#define FASTCGI_BLOG_OUTPUT_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+
+// Destination of a rendered page. Nested templates append to the same buffer,
+// which is handed to write() in chunks once it grows over chunkSize.
+// The base class keeps the whole page in the buffer.
+
+class Output {
+
+private:
+
+    std::string buffer;
+    size_t chunkSize;
+    size_t size = 0;
+
+protected:
+
+    virtual void write(std::string_view) {
+    }
+
+public:
+
+    explicit Output(size_t chunkSize = SIZE_MAX) {
+        this->chunkSize = chunkSize;
+    }
+
+    virtual ~Output() = default;
+
+    void append(std::string_view s) {
+        buffer.append(s);
+        size += s.size();
+        if (buffer.size() >= chunkSize)
+            flush();
+    }
+
+    void flush() {
+        if (buffer.empty() || chunkSize == SIZE_MAX)
+            return;
+        write(buffer);
+        buffer.clear();
+    }
+
+    // Empties the buffer keeping its memory, so one output can be reused for many pages
+    void clear() {
+        buffer.clear();
+        size = 0;
+    }
+
+    // Bytes appended since the last clear, written or not
+    size_t getSize() const {
+        return size;
+    }
+
+    // Text not handed to write() yet, the whole page for the base class
+    std::string& getBuffer() {
+        return buffer;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_OUTPUT_H
@@ -0,0 +1,162 @@
+#ifndef FASTCGI_BLOG_PRERENDER_H
+#define FASTCGI_BLOG_PRERENDER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+
+#include "Tree.h"
+#include "Generator.h"
+#include "ThreadPool.h"
+
+// Renders every page of the tree, its directories and the files in them, into <outDir><uri>/index.html, so a web server can serve them as files.
+// Pages reading request variables can not be rendered ahead and are skipped,
+// pages over the default render budget are not written.
+
+class Prerender {
+
+public:
+
+    struct Settings {
+        std::string templateHome = "home";
+        std::string template404 = "404";
+        std::string templatesPath;
+        size_t threads = 0;
+        bool gzip = false;
+        int gzipLevel = 6;
+    };
+
+    struct Result {
+        size_t pages = 0;
+        std::vector<std::string> skipped; // request dependent
+        std::vector<std::string> failed;  // not written or over the render budget
+        double seconds = 0;
+    };
+
+private:
+
+    static bool WriteFile(const std::string& path, const std::string& content) {
+        std::ofstream os(path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        os.write(content.data(), (std::streamsize)content.size());
+        return (bool)os;
+    }
+
+    // A json file without a template part, like "params.json"
+    static bool IsPlainJson(std::string_view key) {
+        return Utils::EndsWith(key, ".json") && key.find('.') == key.size() - 5;
+    }
+
+    // Pages are the directories and their files, except plain json data
+    // and the html files of the templates directory
+    static void CollectPages(Node* directory, Node* templates, std::vector<Node*>& result) {
+        result.push_back(directory);
+        for (size_t i = 0; i < directory->getChildCount(); i++) {
+            Node* child = directory->getChild(i);
+            if (child->isDirectory())
+                CollectPages(child, templates, result);
+            else if (!IsPlainJson(child->getKey()) &&
+                     !(directory == templates && Utils::EndsWith(child->getKey(), ".html")))
+                result.push_back(child);
+        }
+    }
+
+    static Generator::RenderInfo Render(Tree& tree, Node* page, const std::string& templateName, const Settings& settings,
+                                        Output& out) {
+        Generator::RenderInfo info;
+        out.clear();
+        Generator::Generate(tree, page, tree.getRoot(), templateName, nullptr, settings.templatesPath, out, &info);
+        return info;
+    }
+
+    static bool Write(const std::string& file, const std::string& page, const Settings& settings) {
+        if (!WriteFile(file, page))
+            return false;
+        std::string compressed;
+        if (settings.gzip && Utils::Gzip(page, compressed, settings.gzipLevel))
+            return WriteFile(file + ".gz", compressed);
+        return true;
+    }
+
+public:
+
+    static Result Run(Tree& tree, const std::string& outDir, const Settings& settings) {
+
+        auto start = std::chrono::steady_clock::now();
+
+        Result result;
+        std::mutex resultMutex;
+
+        std::vector<Node*> nodes;
+        Node* templates = tree.getRoot()->getFirst(settings.templatesPath);
+        CollectPages(tree.getRoot(), templates, nodes);
+
+        std::error_code ec;
+        std::filesystem::create_directories(outDir, ec);
+
+        {
+            ThreadPool pool(settings.threads);
+            size_t chunk = std::max<size_t>(64, nodes.size() / (pool.size() * 8) + 1);
+
+            for (size_t first = 0; first < nodes.size(); first += chunk) {
+                pool.push([&, first]() {
+
+                    Output out;
+
+                    for (size_t i = first; i < std::min(first + chunk, nodes.size()); i++) {
+
+                        // Only the node a request for its URI resolves to
+                        std::string uri = nodes[i]->getUri();
+                        if (uri.back() == '/' && uri.size() > 1)
+                            continue;
+                        if (tree.resolve(uri) != nodes[i])
+                            continue;
+
+                        auto info = Render(tree, nodes[i], settings.templateHome, settings, out);
+                        bool rendered = !info.requestDependent;
+
+                        bool written = false;
+                        if (rendered && !info.aborted) {
+                            std::error_code ec;
+                            std::string dir = outDir + (uri == "/" ? "" : uri);
+                            std::filesystem::create_directories(dir, ec);
+                            written = !ec && Write(dir + "/index.html", out.getBuffer(), settings);
+                        }
+
+                        std::lock_guard<std::mutex> lock(resultMutex);
+                        if (!rendered)
+                            result.skipped.push_back(uri);
+                        else if (!written)
+                            result.failed.push_back(uri);
+                        else
+                            result.pages++;
+                    }
+                });
+            }
+
+            pool.wait();
+        }
+
+        // Page for URIs that resolve to nothing
+        Output out;
+        if (!settings.template404.empty()) {
+            auto info = Render(tree, tree.getRoot(), settings.template404, settings, out);
+            if (info.requestDependent)
+                result.skipped.push_back(settings.template404);
+            else if (info.aborted || !Write(outDir + "/" + settings.template404 + ".html", out.getBuffer(), settings))
+                result.failed.push_back(settings.template404);
+        }
+
+        std::sort(result.skipped.begin(), result.skipped.end());
+        std::sort(result.failed.begin(), result.failed.end());
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_PRERENDER_H
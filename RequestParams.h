@@ -0,0 +1,19 @@
+#ifndef FASTCGI_BLOG_REQUESTPARAMS_H
+#define FASTCGI_BLOG_REQUESTPARAMS_H
+
+#include <string_view>
+
+// Variables of the request a page is rendered for, what templates read of it
+
+class RequestParams {
+
+public:
+
+    virtual ~RequestParams() = default;
+
+    // Empty when the web server did not pass it
+    virtual std::string_view getParam(std::string_view name) const = 0;
+
+};
+
+#endif //FASTCGI_BLOG_REQUESTPARAMS_H
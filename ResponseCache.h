@@ -0,0 +1,132 @@
+#ifndef FASTCGI_BLOG_RESPONSECACHE_H
+#define FASTCGI_BLOG_RESPONSECACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+// Complete rendered responses keyed by normalized URI.
+// Entries belong to one tree generation, the whole cache is dropped when a newer generation shows up.
+
+class ResponseCache {
+
+public:
+
+    struct Response {
+        std::string status;
+        std::string headers;
+        std::string body;
+
+        // Compressed body, empty if it is not worth compressing
+        std::string gzipBody;
+
+        // Quoted entity tags of both bodies, empty for pages that are not revalidated
+        std::string etag;
+        std::string gzipETag;
+
+        // Marks a page that reads request variables: nothing to reuse, render it for every request
+        bool requestDependent = false;
+
+        size_t size() const {
+            return status.size() + headers.size() + body.size() + gzipBody.size() + etag.size() + gzipETag.size();
+        }
+    };
+
+private:
+
+    struct Entry {
+        std::string uri;
+        std::shared_ptr<const Response> response;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t maxBytes;
+    size_t bytes = 0;
+    uint64_t generation = 0;
+    std::mutex mutex;
+
+    void setGeneration(uint64_t newGeneration) {
+        if (newGeneration <= generation)
+            return;
+        entries.clear();
+        index.clear();
+        bytes = 0;
+        generation = newGeneration;
+    }
+
+    static size_t entrySize(const Entry& e) {
+        return e.uri.size() + e.response->size();
+    }
+
+public:
+
+    explicit ResponseCache(size_t maxBytes) {
+        this->maxBytes = maxBytes;
+    }
+
+    std::shared_ptr<const Response> get(const std::string& uri, uint64_t treeGeneration) {
+        std::lock_guard<std::mutex> lock(mutex);
+        setGeneration(treeGeneration);
+        if (treeGeneration != generation)
+            return nullptr;
+
+        auto it = index.find(uri);
+        if (it == index.end())
+            return nullptr;
+
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->response;
+    }
+
+    void put(const std::string& uri, uint64_t treeGeneration, std::shared_ptr<const Response> response) {
+        if (uri.size() + response->size() > maxBytes)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        setGeneration(treeGeneration);
+        // Rendered against a tree that has been replaced already
+        if (treeGeneration != generation)
+            return;
+
+        auto it = index.find(uri);
+        if (it != index.end()) {
+            bytes -= entrySize(*it->second);
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        entries.push_front({uri, std::move(response)});
+        index[uri] = entries.begin();
+        bytes += entrySize(entries.front());
+
+        // Evict least recently used entries
+        while (bytes > maxBytes) {
+            bytes -= entrySize(entries.back());
+            index.erase(entries.back().uri);
+            entries.pop_back();
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        bytes = 0;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    size_t getBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytes;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_RESPONSECACHE_H
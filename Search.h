@@ -0,0 +1,311 @@
+#ifndef FASTCGI_BLOG_SEARCH_H
+#define FASTCGI_BLOG_SEARCH_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Inverted index of the words of documents. Words are runs of ASCII letters and digits, lowercased,
+// and of bytes over 127, so UTF-8 words are kept whole. A document is added as texts following addDocument().
+// A query matches the documents having all of its words, ranked by BM25.
+
+class SearchIndex {
+
+public:
+
+    struct Result {
+        uint32_t id;
+        double score;
+    };
+
+private:
+
+    struct Posting {
+        uint32_t document;
+        uint32_t count;
+    };
+
+    struct Term {
+        std::string word;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    static constexpr double k1 = 1.2;
+    static constexpr double b = 0.75;
+
+    // Postings of the documents added so far, moved into terms by finish()
+    std::unordered_map<std::string, std::vector<Posting>> building;
+
+    std::vector<Term> terms;        // sorted by word
+    std::vector<Posting> postings;  // of every term in document order
+    std::vector<uint32_t> ids;      // of the documents
+    std::vector<uint32_t> lengths;  // words of the documents
+    uint64_t totalLength = 0;
+
+    static bool isWordByte(unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 128;
+    }
+
+    // Calls f for every word of the text, lowercased
+    template <typename F>
+    static void ForEachWord(std::string_view text, std::string& word, F f) {
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && !isWordByte((unsigned char)text[i]))
+                i++;
+            word.clear();
+            while (i < text.size() && isWordByte((unsigned char)text[i])) {
+                char c = text[i++];
+                word += c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+            }
+            if (!word.empty())
+                f(std::string_view(word));
+        }
+    }
+
+    template <typename T>
+    static void Append(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool Read(std::string_view& data, T& value) {
+        if (data.size() < sizeof(value))
+            return false;
+        memcpy(&value, data.data(), sizeof(value));
+        data.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    template <typename T>
+    static bool ReadVector(std::string_view& data, std::vector<T>& values, uint64_t count) {
+        if (count > data.size() / sizeof(T))
+            return false;
+        values.resize(count);
+        if (count)
+            memcpy(values.data(), data.data(), count * sizeof(T));
+        data.remove_prefix(count * sizeof(T));
+        return true;
+    }
+
+    const Term* findTerm(std::string_view word) const {
+        auto it = std::lower_bound(terms.begin(), terms.end(), word, [](const Term& t, std::string_view w) {
+            return t.word < w;
+        });
+        return it != terms.end() && it->word == word ? &*it : nullptr;
+    }
+
+public:
+
+    // Starts a document, the texts added next belong to it
+    void addDocument(uint32_t id) {
+        ids.push_back(id);
+        lengths.push_back(0);
+    }
+
+    void addText(std::string_view text) {
+        if (ids.empty())
+            return;
+        auto document = (uint32_t)(ids.size() - 1);
+        std::string word;
+        ForEachWord(text, word, [&](std::string_view w) {
+            auto &list = building[std::string(w)];
+            if (!list.empty() && list.back().document == document)
+                list.back().count++;
+            else
+                list.push_back({document, 1});
+            lengths.back()++;
+            totalLength++;
+        });
+    }
+
+    // Makes the added documents searchable, none can be added after
+    void finish() {
+        terms.clear();
+        postings.clear();
+        terms.reserve(building.size());
+        for (auto &term : building)
+            terms.push_back({term.first, 0, (uint32_t)term.second.size()});
+        std::sort(terms.begin(), terms.end(), [](const Term& a, const Term& b) {
+            return a.word < b.word;
+        });
+        for (auto &term : terms) {
+            auto &list = building[term.word];
+            term.first = (uint32_t)postings.size();
+            postings.insert(postings.end(), list.begin(), list.end());
+        }
+        building.clear();
+    }
+
+    // At most limit documents having all words of the query, best first. No words matches nothing.
+    void search(std::string_view query, size_t limit, std::vector<Result>& results) const {
+
+        results.clear();
+        if (!limit || ids.empty())
+            return;
+
+        // Scratch of the searching thread, searches do not allocate once it has grown
+        thread_local std::string word;
+        thread_local std::vector<const Term*> queryTerms;
+        thread_local std::vector<uint32_t> cursors;
+        queryTerms.clear();
+
+        bool missing = false;
+        ForEachWord(query, word, [&](std::string_view w) {
+            const Term* term = findTerm(w);
+            if (!term)
+                missing = true;
+            else if (std::find(queryTerms.begin(), queryTerms.end(), term) == queryTerms.end())
+                queryTerms.push_back(term);
+        });
+        if (missing || queryTerms.empty())
+            return;
+
+        // Candidates come from the rarest word, the others are looked up in their postings ahead of the last match
+        std::sort(queryTerms.begin(), queryTerms.end(), [](const Term* a, const Term* b) {
+            return a->count < b->count;
+        });
+        cursors.assign(queryTerms.size(), 0);
+        for (size_t t = 0; t < queryTerms.size(); t++)
+            cursors[t] = queryTerms[t]->first;
+
+        auto documents = (double)ids.size();
+        double averageLength = std::max(1.0, (double)totalLength / documents);
+
+        const Term* rarest = queryTerms[0];
+        for (uint32_t p = rarest->first; p < rarest->first + rarest->count; p++) {
+
+            uint32_t document = postings[p].document;
+            double normalization = k1 * (1 - b + b * lengths[document] / averageLength);
+            double score = 0;
+            bool all = true;
+
+            for (size_t t = 0; t < queryTerms.size() && all; t++) {
+                const Term* term = queryTerms[t];
+                const Posting* end = postings.data() + term->first + term->count;
+                const Posting* posting = std::lower_bound(postings.data() + cursors[t], end, document,
+                                                          [](const Posting& a, uint32_t d) {
+                                                              return a.document < d;
+                                                          });
+                cursors[t] = (uint32_t)(posting - postings.data());
+                if (posting == end || posting->document != document) {
+                    all = false;
+                    break;
+                }
+                double idf = std::log(1 + (documents - term->count + 0.5) / (term->count + 0.5));
+                score += idf * posting->count * (k1 + 1) / (posting->count + normalization);
+            }
+
+            if (all)
+                results.push_back({ids[document], score});
+        }
+
+        // Equal scores keep the document order
+        auto better = [](const Result& a, const Result& b) {
+            return a.score > b.score || (a.score == b.score && a.id < b.id);
+        };
+        if (results.size() > limit) {
+            std::partial_sort(results.begin(), results.begin() + (std::ptrdiff_t)limit, results.end(), better);
+            results.resize(limit);
+        }
+        else
+            std::sort(results.begin(), results.end(), better);
+    }
+
+    // Appends the finished index to out, for load() in another process
+    void save(std::string& out) const {
+        Append(out, (uint64_t)terms.size());
+        Append(out, (uint64_t)postings.size());
+        Append(out, (uint64_t)ids.size());
+        Append(out, totalLength);
+        for (const auto &term : terms) {
+            Append(out, (uint32_t)term.word.size());
+            out += term.word;
+            Append(out, term.first);
+            Append(out, term.count);
+        }
+        out.append(reinterpret_cast<const char*>(postings.data()), postings.size() * sizeof(Posting));
+        out.append(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(uint32_t));
+        out.append(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(uint32_t));
+    }
+
+    // Replaces the index with one written by save(), false and empty if the data is broken
+    bool load(std::string_view data) {
+
+        clear();
+        uint64_t termCount, postingCount, documentCount;
+        bool valid = Read(data, termCount) && Read(data, postingCount) && Read(data, documentCount) &&
+                     Read(data, totalLength) && termCount <= data.size();
+
+        if (valid)
+            terms.resize(termCount);
+        for (uint64_t i = 0; i < termCount && valid; i++) {
+            uint32_t length;
+            valid = Read(data, length) && length <= data.size();
+            if (!valid)
+                break;
+            terms[i].word.assign(data.data(), length);
+            data.remove_prefix(length);
+            valid = Read(data, terms[i].first) && Read(data, terms[i].count) &&
+                    (uint64_t)terms[i].first + terms[i].count <= postingCount;
+        }
+
+        valid = valid && ReadVector(data, postings, postingCount) && ReadVector(data, ids, documentCount) &&
+                ReadVector(data, lengths, documentCount) && data.empty();
+        // Searches index lengths by the documents of the postings
+        for (size_t i = 0; i < postings.size() && valid; i++)
+            valid = postings[i].document < documentCount;
+
+        if (!valid)
+            clear();
+        return valid;
+    }
+
+    // True if every document id is below count
+    bool isWithin(size_t count) const {
+        return std::all_of(ids.begin(), ids.end(), [&](uint32_t id) {
+            return id < count;
+        });
+    }
+
+    void clear() {
+        building.clear();
+        terms.clear();
+        postings.clear();
+        ids.clear();
+        lengths.clear();
+        totalLength = 0;
+    }
+
+    size_t getDocumentCount() const {
+        return ids.size();
+    }
+
+    size_t getTermCount() const {
+        return terms.size();
+    }
+
+    size_t getPostingCount() const {
+        return postings.size();
+    }
+
+    // Held by the index, words within the string object are not counted twice
+    size_t getBytes() const {
+        size_t bytes = terms.capacity() * sizeof(Term) + postings.capacity() * sizeof(Posting) +
+                       ids.capacity() * sizeof(uint32_t) + lengths.capacity() * sizeof(uint32_t);
+        for (const auto &term : terms)
+            if (term.word.capacity() > std::string().capacity())
+                bytes += term.word.capacity() + 1;
+        return bytes;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_SEARCH_H
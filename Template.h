@@ -0,0 +1,481 @@
+#ifndef FASTCGI_BLOG_TEMPLATE_H
+#define FASTCGI_BLOG_TEMPLATE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <regex>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Utils.h"
+
+// Template source compiled into a flat list of instructions.
+// Text instructions point into the source string, so a Template must not outlive it.
+
+class Template {
+
+public:
+
+    enum class Function {
+        Text,
+        Print,
+        Template,
+        If,
+        EndIf,
+        Search
+    };
+
+    // Argument that is a number or a '$VARIABLE' holding one
+    struct Count {
+        size_t value = 0;
+        std::string variable;
+    };
+
+    struct Instruction {
+        Function function = Function::Text;
+
+        // Text
+        std::string_view text;
+
+        // Print, If, Search: '$VARIABLE' or a node path ('@' prefix is stripped into `current`)
+        std::string variable;
+        bool current = false;
+        std::string path;
+
+        // Print: explicit sub-template name, Search: template of the results
+        std::string subTemplateName;
+
+        // Search: words to look for unless they come from the variable, a query string variable gives its q parameter
+        std::string query;
+
+        // Print: sort=[-]path limit=N offset=N page=N, the nodes are ordered by the value at the path under each
+        // of them and sliced, page N starts at offset (N - 1) * limit
+        bool sliced = false;
+        std::string sortKey;
+        bool descending = false;
+        Count limit{SIZE_MAX, {}}; // Search: 10 by default
+        Count offset;
+        Count page;
+
+        // Template: sub-template names
+        std::vector<std::string> templateNames;
+
+        // If: compiled condition, null when the expression is invalid
+        std::shared_ptr<const std::regex> condition;
+    };
+
+    // Tag found in a template source: <!-- function(arguments) -->
+    struct Tag {
+        size_t position = 0;
+        size_t length = 0;
+        std::string_view function;
+        std::string_view arguments;
+    };
+
+    // Finds the first tag at or after `from`, same as searching for <!--\s*(\w+)\((.*?)\)\s*--> with std::regex
+    static bool FindTag(std::string_view source, size_t from, Tag& tag) {
+        for (size_t p = findCommentStart(source, from); p != std::string_view::npos; p = findCommentStart(source, p + 1))
+            if (parseTag(source, p, tag))
+                return true;
+        return false;
+    }
+
+    explicit Template(std::string_view source) {
+
+        Tag tag;
+        size_t lastPartPos = 0;
+
+        while (FindTag(source, lastPartPos, tag)) {
+            std::vector<std::string> params = Utils::Tokenize(std::string(tag.arguments));
+
+            appendText(source.substr(lastPartPos, tag.position - lastPartPos));
+            lastPartPos = tag.position + tag.length;
+
+            Instruction instruction;
+
+            if (tag.function == "print" && !params.empty()) {
+                instruction.function = Function::Print;
+                setNodeReference(instruction, params[0]);
+                for (size_t i = 1; i < params.size(); i++) {
+                    size_t eq = params[i].find('=');
+                    if (eq == std::string::npos) {
+                        if (i == 1)
+                            instruction.subTemplateName = params[1];
+                        continue;
+                    }
+                    setPrintOption(instruction, params[i].substr(0, eq), params[i].substr(eq + 1));
+                }
+            }
+
+            else if (tag.function == "template" && !params.empty()) {
+                instruction.function = Function::Template;
+                instruction.templateNames = params;
+            }
+
+            else if (tag.function == "if" && params.size() == 2) {
+                instruction.function = Function::If;
+                setNodeReference(instruction, params[0]);
+                try {
+                    instruction.condition = std::make_shared<const std::regex>(params[1]);
+                } catch (const std::regex_error&) {
+                    instruction.condition = nullptr;
+                }
+            }
+
+            else if (tag.function == "search" && params.size() >= 2) {
+                instruction.function = Function::Search;
+                if (params[0][0] == '$')
+                    instruction.variable = params[0];
+                else
+                    instruction.query = params[0];
+                instruction.subTemplateName = params[1];
+                instruction.limit.value = 10;
+                if (params.size() > 2)
+                    setCount(instruction.limit, params[2]);
+            }
+
+            else if (tag.function == "endif")
+                instruction.function = Function::EndIf;
+
+            else {
+                // Unknown or malformed tags are printed as is
+                appendText(source.substr(tag.position, tag.length));
+                continue;
+            }
+
+            instructions.push_back(std::move(instruction));
+        }
+
+        appendText(source.substr(lastPartPos));
+    }
+
+    const std::vector<Instruction>& getInstructions() const {
+        return instructions;
+    }
+
+private:
+
+    std::vector<Instruction> instructions;
+
+    // Character classes of std::regex in the classic locale
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    static bool isWord(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    // Position of the next "<!--" at or after `from`, vectorized search for '<' followed by '!'
+    static size_t findCommentStart(std::string_view s, size_t from) {
+
+        const char* data = s.data();
+        size_t n = s.size();
+        size_t i = from;
+
+#if defined(__AVX2__)
+        const __m256i lt32 = _mm256_set1_epi8('<');
+        const __m256i ex32 = _mm256_set1_epi8('!');
+        for (; i + 33 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+            auto mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, lt32),
+                                                                         _mm256_cmpeq_epi8(b, ex32)));
+            for (; mask; mask &= mask - 1) {
+                size_t p = i + __builtin_ctz(mask);
+                if (p + 4 <= n && data[p + 2] == '-' && data[p + 3] == '-')
+                    return p;
+            }
+        }
+#endif
+
+#if defined(__SSE2__)
+        const __m128i lt16 = _mm_set1_epi8('<');
+        const __m128i ex16 = _mm_set1_epi8('!');
+        for (; i + 17 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+            auto mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, lt16), _mm_cmpeq_epi8(b, ex16)));
+            for (; mask; mask &= mask - 1) {
+                size_t p = i + __builtin_ctz(mask);
+                if (p + 4 <= n && data[p + 2] == '-' && data[p + 3] == '-')
+                    return p;
+            }
+        }
+#endif
+
+        while (i + 4 <= n) {
+            auto p = static_cast<const char*>(memchr(data + i, '<', n - 3 - i));
+            if (!p)
+                break;
+            i = p - data;
+            if (data[i + 1] == '!' && data[i + 2] == '-' && data[i + 3] == '-')
+                return i;
+            i++;
+        }
+
+        return std::string_view::npos;
+    }
+
+    // Parses the tag at "<!--" in position p, false if there is none
+    static bool parseTag(std::string_view s, size_t p, Tag& tag) {
+
+        size_t n = s.size();
+        size_t i = p + 4;
+
+        while (i < n && isSpace(s[i]))
+            i++;
+        size_t functionStart = i;
+        while (i < n && isWord(s[i]))
+            i++;
+        if (i == functionStart || i == n || s[i] != '(')
+            return false;
+        size_t argumentsStart = ++i;
+
+        // The shortest arguments followed by ")\s*-->", they do not span lines like '.' in a regex
+        for (; i < n && s[i] != '\n' && s[i] != '\r'; i++) {
+            if (s[i] != ')')
+                continue;
+            size_t j = i + 1;
+            while (j < n && isSpace(s[j]))
+                j++;
+            if (s.compare(j, 3, "-->") == 0) {
+                tag.position = p;
+                tag.length = j + 3 - p;
+                tag.function = s.substr(functionStart, argumentsStart - 1 - functionStart);
+                tag.arguments = s.substr(argumentsStart, i - argumentsStart);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void appendText(std::string_view text) {
+        if (text.empty())
+            return;
+
+        // Merge adjacent text spans, they are contiguous in the source
+        if (!instructions.empty() && instructions.back().function == Function::Text &&
+            instructions.back().text.data() + instructions.back().text.size() == text.data()) {
+            instructions.back().text = std::string_view(instructions.back().text.data(),
+                                                        instructions.back().text.size() + text.size());
+            return;
+        }
+
+        Instruction instruction;
+        instruction.text = text;
+        instructions.push_back(std::move(instruction));
+    }
+
+    static void setCount(Count& count, const std::string& value) {
+        if (!value.empty() && value[0] == '$')
+            count.variable = value;
+        else
+            count.value = (size_t)strtoull(value.c_str(), nullptr, 10);
+    }
+
+    // Unknown options are ignored
+    static void setPrintOption(Instruction& instruction, const std::string& name, const std::string& value) {
+        if (name == "sort" && !value.empty()) {
+            instruction.descending = value[0] == '-';
+            instruction.sortKey = instruction.descending ? value.substr(1) : value;
+        }
+        else if (name == "limit")
+            setCount(instruction.limit, value);
+        else if (name == "offset")
+            setCount(instruction.offset, value);
+        else if (name == "page")
+            setCount(instruction.page, value);
+        else
+            return;
+        instruction.sliced = true;
+    }
+
+    static void setNodeReference(Instruction& instruction, const std::string& param) {
+        if (param[0] == '$') {
+            instruction.variable = param;
+            return;
+        }
+
+        std::string path = param;
+        if (path[0] == '@') {
+            path = path.substr(1);
+            instruction.current = true;
+        }
+        instruction.path = path;
+    }
+
+};
+
+// Compiled templates keyed by the node holding the template source.
+// Sources are copied, lazily loaded ones may be evicted while the template is in use.
+
+class Metrics;
+struct TemplateMetrics;
+
+class TemplateCache {
+
+public:
+
+    // The metrics of a template are looked up once, for the metrics it is first rendered with
+    struct Entry {
+        std::string source;
+        std::unique_ptr<const Template> compiled;
+        const Metrics* metricsOwner = nullptr;
+        TemplateMetrics* metrics = nullptr;
+    };
+
+private:
+
+    std::unordered_map<const void*, std::unique_ptr<const Entry>> templates;
+    mutable std::shared_mutex mutex;
+
+public:
+
+    // load() returns the source and resolve(Entry&) sets the metrics, both are only called when the template is not compiled yet
+    template <typename Load, typename Resolve>
+    const Entry& get(const void* key, Load load, Resolve resolve) {
+        {
+            std::shared_lock lock(mutex);
+            auto it = templates.find(key);
+            if (it != templates.end())
+                return *it->second;
+        }
+
+        auto entry = std::make_unique<Entry>();
+        entry->source = load();
+        entry->compiled = std::make_unique<const Template>(entry->source);
+        resolve(*entry);
+
+        std::unique_lock lock(mutex);
+        auto &slot = templates[key];
+        if (!slot)
+            slot = std::move(entry);
+        return *slot;
+    }
+
+    void clear() {
+        std::unique_lock lock(mutex);
+        templates.clear();
+    }
+
+    size_t size() const {
+        std::shared_lock lock(mutex);
+        return templates.size();
+    }
+
+};
+
+// Rendered templates keyed by the template node and the data node they were rendered for.
+// Only renders that read nothing else are kept, the others are remembered as uncacheable.
+
+class FragmentCache {
+
+public:
+
+    enum class Result {
+        Hit,
+        Miss,
+        Uncacheable
+    };
+
+    struct Fragment {
+        bool cacheable = false;
+        std::string text;
+    };
+
+private:
+
+    struct Key {
+        const void* templateNode;
+        const void* dataNode;
+
+        bool operator==(const Key& other) const {
+            return templateNode == other.templateNode && dataNode == other.dataNode;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<const void*>()(key.templateNode) * 31 + std::hash<const void*>()(key.dataNode);
+        }
+    };
+
+    std::unordered_map<Key, Fragment, KeyHash> fragments;
+    mutable std::shared_mutex mutex;
+    std::atomic<size_t> bytes{0};
+    size_t maxBytes = SIZE_MAX;
+    std::atomic<uint64_t> counts[3] = {};
+
+public:
+
+    // Null when the pair was not rendered yet. Fragments stay until clear(), so the pointer does too.
+    const Fragment* get(const void* templateNode, const void* dataNode) const {
+        std::shared_lock lock(mutex);
+        auto it = fragments.find({templateNode, dataNode});
+        return it == fragments.end() ? nullptr : &it->second;
+    }
+
+    // Texts over the size limit are not kept
+    void put(const void* templateNode, const void* dataNode, bool cacheable, std::string_view text) {
+        if (cacheable && bytes.load(std::memory_order_relaxed) + text.size() > maxBytes)
+            return;
+
+        std::unique_lock lock(mutex);
+        auto [it, inserted] = fragments.try_emplace({templateNode, dataNode});
+        if (!inserted)
+            return;
+        it->second.cacheable = cacheable;
+        if (cacheable) {
+            it->second.text = text;
+            bytes += text.size();
+        }
+    }
+
+    bool isFull() const {
+        return bytes.load(std::memory_order_relaxed) >= maxBytes;
+    }
+
+    void setMaxBytes(size_t maxBytes) {
+        this->maxBytes = maxBytes;
+    }
+
+    void count(Result result) {
+        counts[(int)result].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t getCount(Result result) const {
+        return counts[(int)result].load(std::memory_order_relaxed);
+    }
+
+    size_t getBytes() const {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+    size_t size() const {
+        std::shared_lock lock(mutex);
+        return fragments.size();
+    }
+
+    void clear() {
+        std::unique_lock lock(mutex);
+        fragments.clear();
+        bytes = 0;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_TEMPLATE_H
@@ -0,0 +1,87 @@
+#ifndef FASTCGI_BLOG_THREADPOOL_H
+#define FASTCGI_BLOG_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Fixed set of threads running queued tasks. Tasks may push more tasks,
+// wait() returns once the queue is empty and nothing is running.
+
+class ThreadPool {
+
+private:
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskAdded;
+    std::condition_variable tasksDone;
+    size_t pending = 0; // queued and running tasks
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAdded.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                tasksDone.notify_all();
+        }
+    }
+
+public:
+
+    // 0 threads means one per core
+    explicit ThreadPool(size_t size = 0) {
+        if (!size)
+            size = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < size; i++)
+            threads.emplace_back(&ThreadPool::run, this);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAdded.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    void push(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+            pending++;
+        }
+        taskAdded.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasksDone.wait(lock, [this]() { return pending == 0; });
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+};
+
+#endif //FASTCGI_BLOG_THREADPOOL_H
@@ -6,97 +6,201 @@
 #define FASTCGI_BLOG_TREE_H
 
 #include <vector>
-#include <tuple>
 #include <string>
 #include <filesystem>
 #include <regex>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <cmath>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "Utils.h"
+#include "Template.h"
+#include "ThreadPool.h"
+#include "Search.h"
+#include "TreeStats.h"
 
+#include "rapidjson/reader.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 
-class Node {
+// Node of a tree under construction, Tree::build packs them into the tree arena
 
-private:
+class NodeBuilder {
+
+public:
 
-    std::vector<std::tuple<std::string, Node*>> sub;
-    Node* parent;
     std::string key;
     std::string value;
+    std::vector<NodeBuilder> sub;
 
-public:
+    // Source file or directory state, mtime is -1 for nodes built from json
+    int64_t mtime = -1;
+    uint64_t size = 0;
 
-    Node(const std::string& value = "", const std::string& key = "", Node* parent = nullptr) {
-        this->value = value;
-        this->parent = parent;
+    // The file content is read on first use instead of into value
+    bool lazy = false;
+
+    bool directory = false;
+
+    // A json string, json numbers, bools and nulls are not text
+    bool text = false;
+
+    // Spent in build() on this node, not on its sub nodes
+    uint64_t buildTime = 0;
+
+    explicit NodeBuilder(const std::string& key = "") {
         this->key = key;
     }
 
-    ~Node() {
-        for (const auto &n : sub)
-            delete std::get<1>(n);
-    }
+    // Builds the nodes of a json file as rapidjson reads it, with no document in between.
+    // Numbers keep the text they are written with.
+    class JsonHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonHandler> {
+
+    private:
+
+        struct Level {
+            NodeBuilder* node;
+            bool array;
+            size_t items;
+        };
+
+        NodeBuilder& file;
+        std::vector<Level> levels;
+        std::string key;
+
+        // Node of the next value, the file node itself for the top value
+        NodeBuilder& next() {
+            if (levels.empty())
+                return file;
+            Level& level = levels.back();
+            level.node->sub.emplace_back(level.array ? std::to_string(level.items) : key);
+            level.items++;
+            return level.node->sub.back();
+        }
 
-    void buildFromJson(rapidjson::Value& json) {
+        bool open(bool array) {
+            // Sub nodes of the containers above are not added until this one ends, so the reference holds
+            levels.push_back({&next(), array, 0});
+            return true;
+        }
 
-        if (json.IsObject()) {
-            for (auto& [key, value] : json.GetObject()) {
-                auto keyStr = key.GetString();
-                Node* n = new Node("", keyStr, this);
-                sub.emplace_back(keyStr, n);
-                n->buildFromJson(value);
-            }
+    public:
+
+        explicit JsonHandler(NodeBuilder& file) : file(file) {
         }
 
-        else if (json.IsArray()) {
-            int i = 0;
-            for (auto& item: json.GetArray()) {
-                auto keyStr = std::to_string(i);
-                Node* n = new Node("", keyStr, this);
-                sub.emplace_back(keyStr, n);
-                n->buildFromJson(item);
-                i++;
-            }
+        bool Null() {
+            next();
+            return true;
+        }
+
+        bool Bool(bool b) {
+            next().value = b ? "true" : "false";
+            return true;
+        }
 
+        bool RawNumber(const char* s, rapidjson::SizeType length, bool) {
+            next().value.assign(s, length);
+            return true;
         }
 
-        else if (json.IsString()) {
-            value = json.GetString();
+        bool String(const char* s, rapidjson::SizeType length, bool) {
+            NodeBuilder& n = next();
+            n.value.assign(s, length);
+            n.text = true;
+            return true;
         }
 
-        else if (json.IsInt()) {
-            value = std::to_string(json.GetInt());
+        bool Key(const char* s, rapidjson::SizeType length, bool) {
+            key.assign(s, length);
+            return true;
         }
 
-        else if (json.IsDouble()) {
-            value = std::to_string(json.GetDouble());
+        bool StartObject() {
+            return open(false);
         }
 
-        else if (json.IsInt64()) {
-            value = std::to_string(json.IsInt64());
+        bool EndObject(rapidjson::SizeType) {
+            levels.pop_back();
+            return true;
         }
 
-        else if (json.IsBool()) {
-            value = json.GetBool() ? "true" : "false";
+        bool StartArray() {
+            return open(true);
         }
 
+        bool EndArray(rapidjson::SizeType) {
+            levels.pop_back();
+            return true;
+        }
+
+    };
+
+    // Parses the json text in place, str is modified. Broken json builds nothing.
+    bool buildFromJson(std::string& str) {
+        rapidjson::Reader reader;
+        rapidjson::InsituStringStream stream(&str[0]);
+        JsonHandler handler(*this);
+        if (reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseNumbersAsStringsFlag>(stream, handler))
+            return true;
+        sub.clear();
+        value.clear();
+        return false;
+    }
+
+    // Lists a directory into sub nodes sorted by name, or loads a file.
+    // Sub nodes are built by further pool tasks, the pool must be waited for.
+    // With lazy content only json files are read, their nodes are the tree structure.
+    void build(const std::string& path, ThreadPool& pool, bool lazyContent = false) {
+        auto start = std::chrono::steady_clock::now();
+        load(path, pool, lazyContent);
+        buildTime = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
     }
 
-    void build(const std::string& path) {
+private:
+
+    void load(const std::string& path, ThreadPool& pool, bool lazyContent) {
 
-        if (std::filesystem::is_directory(path)) {
+        std::error_code ec;
+
+        if (!Utils::Stat(path, mtime, size, directory))
+            return;
+
+        if (directory) {
             // Iterate through the files and folders
 
-            for (const auto & item : std::filesystem::directory_iterator(path)) {
+            std::vector<std::string> items;
+            for (const auto & item : std::filesystem::directory_iterator(path, ec)) {
 
                 std::string itemStr = item.path().filename().c_str();
                 if (itemStr.empty() || itemStr[0] == '.')
                     continue;
 
                 // Process txt and json files only
-                if (std::filesystem::is_character_file(item)) {
+                if (std::filesystem::is_character_file(item, ec)) {
                     if (itemStr.find('.') == std::string::npos)
                         continue;
                     std::string ext = itemStr.substr(itemStr.find_last_of('.') + 1);
@@ -104,152 +208,1378 @@ public:
                         continue;
                 }
 
-                Node* n = new Node("", itemStr, this);
-                sub.emplace_back(itemStr, n);
-                n->build(path + '/' + itemStr);
+                items.push_back(itemStr);
+
+            }
+
+            // Directory order is not defined, keep the tree the same on every build
+            std::sort(items.begin(), items.end());
+
+            sub.reserve(items.size());
+            for (const auto &itemStr : items)
+                sub.emplace_back(itemStr);
 
+            for (auto &n : sub) {
+                std::string itemPath = path + '/' + n.key;
+                pool.push([&n, itemPath, &pool, lazyContent]() {
+                    n.build(itemPath, pool, lazyContent);
+                });
             }
-            
+
         } else {
             // Load the file
 
             std::string ext = path.substr(path.find_last_of('.') + 1);
 
-            if (ext == "txt" || ext == "json" || ext == "html") {
+            if ((ext == "txt" || ext == "html") && lazyContent)
+                lazy = true;
+
+            else if (ext == "txt" || ext == "json" || ext == "html") {
+
+                std::string str;
+                if (!Utils::ReadFile(path, str))
+                    return;
+
+                if (ext == "json")
+                    buildFromJson(str);
+                else
+                    value = std::move(str);
+            }
+
+        }
+    }
+
+};
+
+// Contents of files loaded on first use, for trees built with lazy content.
+// Values are kept in least recently used order within a byte budget. They are read within a Scope
+// on the reading thread and a view of a value stays valid until the outermost Scope is closed.
 
-                std::ifstream t(path);
-                std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+class ContentStore {
 
-                if (ext == "json") {
-                    // Parse json and build nodes
+public:
+
+    // Pins the values read by the thread until it is closed, scopes may nest
+    class Scope {
+
+    public:
+
+        Scope() {
+            Pins().depth++;
+        }
 
-                    rapidjson::Document json;
-                    rapidjson::ParseResult result = json.Parse(str.c_str());
-                    if (result)
-                        buildFromJson(json);
+        ~Scope() {
+            auto &pins = Pins();
+            if (--pins.depth == 0)
+                pins.values.clear();
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    };
+
+private:
+
+    struct Entry {
+        std::shared_ptr<const std::string> value;
+        std::list<uint32_t>::iterator position;
+    };
+
+    struct PinList {
+        size_t depth = 0;
+        std::vector<std::shared_ptr<const std::string>> values;
+    };
+
+    std::string root;
+    size_t budget = SIZE_MAX;
+    std::mutex mutex;
+    std::unordered_map<uint32_t, Entry> entries;
+    std::list<uint32_t> order; // most recently used first
+    size_t bytes = 0;
+    std::atomic<uint64_t> loads{0};
+    std::atomic<uint64_t> evictions{0};
+
+    static PinList& Pins() {
+        thread_local PinList pins;
+        return pins;
+    }
+
+    static std::string_view Pin(std::shared_ptr<const std::string> value) {
+        auto &pins = Pins();
+        pins.values.push_back(std::move(value));
+        return *pins.values.back();
+    }
 
+public:
+
+    // Directory the node paths are relative to
+    void setRoot(const std::string& root) {
+        this->root = root;
+    }
+
+    void setBudget(size_t budget) {
+        this->budget = budget;
+    }
+
+    // Value of a node by its index, appendPath(std::string&) writes the node path when the file has to be read
+    template <class F>
+    std::string_view get(uint32_t node, F appendPath) {
+
+        assert(Pins().depth && "lazy values are read within a ContentStore::Scope");
+
+        std::shared_ptr<const std::string> value;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(node);
+            if (it != entries.end()) {
+                order.splice(order.begin(), order, it->second.position);
+                value = it->second.value;
+            }
+        }
+        if (value)
+            return Pin(std::move(value));
+
+        // Read without the lock, other threads keep using loaded values meanwhile
+        std::string path = root;
+        appendPath(path);
+        auto loaded = std::make_shared<std::string>();
+        Utils::ReadFile(path, *loaded);
+        loads.fetch_add(1, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto [it, inserted] = entries.try_emplace(node);
+            if (inserted) {
+                order.push_front(node);
+                it->second = {std::move(loaded), order.begin()};
+                bytes += it->second.value->size();
+
+                // The value just read is kept even when it is over the budget alone
+                while (bytes > budget && order.back() != node) {
+                    auto victim = entries.find(order.back());
+                    bytes -= victim->second.value->size();
+                    entries.erase(victim);
+                    order.pop_back();
+                    evictions.fetch_add(1, std::memory_order_relaxed);
                 }
-                else
-                    value = str;
             }
+            else
+                order.splice(order.begin(), order, it->second.position);
+            value = it->second.value;
+        }
+        return Pin(std::move(value));
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        order.clear();
+        bytes = 0;
+    }
+
+    uint64_t getLoads() const {
+        return loads.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getEvictions() const {
+        return evictions.load(std::memory_order_relaxed);
+    }
+
+    size_t getBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytes;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+};
+
+// Beginning of a tree arena. It is followed by the nodes in breadth-first order,
+// the child indexes and the string pool. Everything inside refers to positions,
+// not addresses, so an arena stays valid wherever its bytes are placed.
+
+struct TreeLayout {
+    uint64_t nodeCount;
+    uint64_t indexesOffset;
+    uint64_t stringsOffset;
+    uint64_t size;
+    ContentStore* content; // set by the owning tree at runtime, null in snapshot files
+};
+
+class Node {
+
+    friend class Tree;
+
+private:
+
+    // Slot of an open addressing child index
+    struct IndexSlot {
+        uint32_t hash;
+        uint32_t child;
+    };
+
+    static constexpr uint32_t emptySlot = UINT32_MAX;
+    static constexpr uint32_t indexThreshold = 8;
+
+    // Flags
+    static constexpr uint32_t lazyValue = 1;
+    static constexpr uint32_t directory = 2;
+    static constexpr uint32_t text = 4;    // json string value
+
+    uint32_t index = 0;       // position in the arena, the root is 0
+    uint32_t parent = 0;
+    uint32_t firstChild = 0;  // children are stored next to each other
+    uint32_t childCount = 0;
+    uint32_t keyLength = 0;
+    uint32_t indexSlots = 0;  // 0 when the children are scanned
+    uint32_t flags = 0;
+    uint64_t keyOffset = 0;   // in the string pool
+    uint64_t valueOffset = 0;
+    uint64_t valueLength = 0;
+    uint64_t indexOffset = 0; // in the index area
+
+    const TreeLayout& layout() const {
+        return *(reinterpret_cast<const TreeLayout*>(this - index) - 1);
+    }
+
+    const char* arena() const {
+        return reinterpret_cast<const char*>(&layout());
+    }
 
+    Node* node(uint32_t i) const {
+        return const_cast<Node*>(this - index) + i;
+    }
+
+    static bool matchStem(std::string_view key, std::string_view s) {
+        // path = 'file', node = 'file.template.json'
+        return key.length() > s.length() && key.compare(0, s.length(), s) == 0 && key[s.length()] == '.';
+    }
+
+    static bool matchDots(std::string_view key, std::string_view s) {
+        // Same as regex_match for a pattern whose only special character is '.'
+        if (key.length() != s.length())
+            return false;
+        for (size_t i = 0; i < s.length(); i++)
+            if (s[i] == '.' ? key[i] == '\n' || key[i] == '\r' : key[i] != s[i])
+                return false;
+        return true;
+    }
+
+    // Writes "/key1/key2" for the path from the root in place, optionally cutting keys at their first dot
+    void appendKeys(std::string& out, bool stems) const {
+
+        auto keyOf = [stems](const Node* n) {
+            auto key = n->getKey();
+            return stems ? key.substr(0, key.find('.')) : key;
+        };
+
+        size_t length = keyOf(node(0)).size();
+        for (const Node* n = this; n->index; n = n->node(n->parent))
+            length += 1 + keyOf(n).size();
+
+        size_t end = out.size() + length;
+        out.resize(end);
+        for (const Node* n = this; ; n = n->node(n->parent)) {
+            auto key = keyOf(n);
+            end -= key.size();
+            memcpy(&out[end], key.data(), key.size());
+            if (!n->index)
+                break;
+            out[--end] = '/';
         }
     }
 
-    std::vector<Node*> get(std::vector<std::string>& pathVector) {
+    // Calls f for the children matching the path segment s in their order, stops when f returns false
+    template <typename F>
+    bool matchEach(std::string_view s, F& f) const {
 
-        if (pathVector.empty())
-            return {};
+        Node* first = node(firstChild);
 
-        std::vector<Node*> result;
-        std::vector<Node*> nodes = {this};
-        std::vector<Node*> newNodes;
+        if (Utils::IsLiteral(s)) {
+            // path = 'file.template.json' or 'file', no regular expression needed
 
-        for (int i = 0; i < pathVector.size(); i++) {
-            std::string& s = pathVector[i];
+            if (!indexSlots) {
+                for (uint32_t i = 0; i < childCount; i++) {
+                    auto key = first[i].getKey();
+                    if ((key == s || matchStem(key, s)) && !f(first + i))
+                        return false;
+                }
+                return true;
+            }
 
-            if (s.empty())
-                newNodes = {getRoot()};
+            // The index holds every key and every key prefix ending before a dot,
+            // hits come in slot order and are sorted back into child order
+            uint32_t inlineHits[16];
+            std::vector<uint32_t> moreHits;
+            size_t hitCount = 0;
 
-            else {
+            auto slots = reinterpret_cast<const IndexSlot*>(arena() + layout().indexesOffset + indexOffset);
+            uint32_t hash = Utils::Hash(s);
+            for (uint32_t i = hash & (indexSlots - 1); slots[i].child != emptySlot; i = (i + 1) & (indexSlots - 1)) {
+                if (slots[i].hash != hash)
+                    continue;
+                auto key = first[slots[i].child].getKey();
+                if (!(key == s || matchStem(key, s)))
+                    continue;
+                if (hitCount < 16)
+                    inlineHits[hitCount] = slots[i].child;
+                else
+                    moreHits.push_back(slots[i].child);
+                hitCount++;
+            }
 
-                std::regex sRegex(s);
+            if (hitCount > 16) {
+                moreHits.insert(moreHits.begin(), inlineHits, inlineHits + 16);
+                std::sort(moreHits.begin(), moreHits.end());
+                moreHits.erase(std::unique(moreHits.begin(), moreHits.end()), moreHits.end());
+                for (auto child : moreHits)
+                    if (!f(first + child))
+                        return false;
+                return true;
+            }
 
-                for (const auto &n : nodes)
-                    for (const auto &n1pair: n->sub) {
-                        Node* n1 = std::get<1>(n1pair);
+            std::sort(inlineHits, inlineHits + hitCount);
+            for (size_t i = 0; i < hitCount; i++)
+                if ((i == 0 || inlineHits[i] != inlineHits[i - 1]) && !f(first + inlineHits[i]))
+                    return false;
+            return true;
+        }
 
-                        if (
-                            // path = 'file.template.json', node = 'file.template.json'
-                            (n1->key == s) ||
+        else if (Utils::IsLiteral(s, ".")) {
+            // path = 'file.template.json' where dots match any character
 
-                            // path = 'file', node = 'file.template.json'
-                            (n1->key.length() > s.length() && n1->key.compare(0, s.length(), s) == 0
-                             && n1->key[s.length()] == '.') ||
+            for (uint32_t i = 0; i < childCount; i++) {
+                auto key = first[i].getKey();
+                if ((matchDots(key, s) || matchStem(key, s)) && !f(first + i))
+                    return false;
+            }
+            return true;
+        }
 
-                            // path = regular expression
-                            std::regex_match(n1->key, sRegex)
-                            )
+        else {
+            // path = regular expression
 
-                            newNodes.push_back(n1);
-                    }
+            auto sRegex = Utils::GetRegex(s);
+            for (uint32_t i = 0; i < childCount; i++) {
+                auto key = first[i].getKey();
+                if ((key == s || matchStem(key, s) || (sRegex && std::regex_match(key.begin(), key.end(), *sRegex))) &&
+                    !f(first + i))
+                    return false;
             }
+            return true;
+        }
 
-            if (i == pathVector.size() - 1)
-                for (const auto &n : newNodes)
-                    result.push_back(n);
+    }
 
-            nodes = newNodes;
-            newNodes.clear();
+    // Matches the segments of the path under this node, it has no empty segments
+    template <typename F>
+    bool visit(std::string_view path, F& f) const {
+        std::string_view s;
+        Utils::NextSegment(path, s, '/');
+        bool last = path.empty();
+        auto step = [&](Node* n) {
+            return last ? f(n) : n->visit(path, f);
+        };
+        return matchEach(s, step);
+    }
+
+public:
 
+    // Calls f for every node matching the path in the order get() returns them, stops when f returns false.
+    // Segments are regular expressions, an empty segment starts over from the root.
+    template <typename F>
+    void forEach(std::string_view path, F f) {
+
+        if (path.empty())
+            return;
+
+        Node* start = this;
+        std::string_view rest = path, s;
+        while (!rest.empty()) {
+            Utils::NextSegment(rest, s, '/');
+            if (s.empty()) {
+                start = getRoot();
+                path = rest;
+            }
         }
 
+        if (path.empty())
+            f(start);
+        else
+            start->visit(path, f);
+    }
+
+    std::vector<Node*> get(std::string_view path) {
+        std::vector<Node*> result;
+        forEach(path, [&](Node* n) {
+            result.push_back(n);
+            return true;
+        });
         return result;
+    }
 
+    Node* getFirst(std::string_view path) {
+        Node* result = nullptr;
+        forEach(path, [&](Node* n) {
+            result = n;
+            return false;
+        });
+        return result;
+    }
+
+    Node* getRoot() const {
+        return node(0);
+    }
+
+    // True if the key matches the path segment the way get() matches it, regex is the compiled segment
+    bool matches(std::string_view s, const std::regex* regex) const {
+        auto key = getKey();
+        if (key == s || matchStem(key, s))
+            return true;
+        if (Utils::IsLiteral(s))
+            return false;
+        if (Utils::IsLiteral(s, "."))
+            return matchDots(key, s);
+        return regex && std::regex_match(key.begin(), key.end(), *regex);
     }
 
-    std::vector<Node*> get(const std::string& path) {
-        auto v = Utils::Split(path, '/');
-        return get(v);
+    bool isDirectory() const {
+        return flags & directory;
     }
 
-    Node* getFirst(const std::string& path) {
-        auto v = Utils::Split(path, '/');
-        auto r = get(v);
-        if (r.empty())
+    Node* getParent() const {
+        if (!index)
             return nullptr;
-        return r[0];
+        return node(parent);
     }
 
-    Node* getRoot() {
-        if (!parent)
-            return this;
-        return parent->getRoot();
+    size_t getChildCount() const {
+        return childCount;
+    }
+
+    Node* getChild(size_t i) const {
+        return node(firstChild + (uint32_t)i);
     }
 
-    const std::string& getValue() {
-        return value;
+    // Values of lazy content are read on first use and only within a ContentStore::Scope
+    std::string_view getValue() const {
+        if (flags & lazyValue)
+            return layout().content->get(index, [this](std::string& path) {
+                appendPath(path);
+            });
+        return {arena() + layout().stringsOffset + valueOffset, valueLength};
     }
 
-    const std::string& getKey() {
-        return key;
+    std::string_view getKey() const {
+        return {arena() + layout().stringsOffset + keyOffset, keyLength};
     }
 
-    std::string getPath() {
-        if (parent)
-            return parent->getPath() + '/' + key;
-        return key;
+    // Appends the keys of the ancestors and the node joined by '/', the root key is empty
+    void appendPath(std::string& out) const {
+        appendKeys(out, false);
+    }
+
+    std::string getPath() const {
+        std::string path;
+        appendPath(path);
+        return path;
+    }
+
+    // URI the node is served at: the path with every key cut at its first dot
+    void appendUri(std::string& out) const {
+        if (!index)
+            out += '/';
+        else
+            appendKeys(out, true);
+    }
+
+    std::string getUri() const {
+        std::string uri;
+        appendUri(uri);
+        return uri;
     }
 
 };
 
+// Children of a node ordered by the value at a path under each of them, like "params/date".
+// Built on first use and kept until the next build, so a list page takes a slice of the index.
+// Values that all read as numbers are compared as numbers, children without the value come last either way.
+
+class SortedIndexes {
+
+private:
+
+    struct Key {
+        const Node* parent;
+        std::string path;
+        bool descending;
+
+        bool operator==(const Key& other) const {
+            return parent == other.parent && path == other.path && descending == other.descending;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<const void*>()(key.parent) * 31 + Utils::Hash(key.path) + key.descending;
+        }
+    };
+
+    std::unordered_map<Key, std::unique_ptr<const std::vector<uint32_t>>, KeyHash> indexes;
+    mutable std::shared_mutex mutex;
+
+public:
+
+    // Sorts the nodes by the value at the path under each of them, equal ones keep their order
+    static void Sort(std::vector<Node*>& nodes, std::string_view path, bool descending) {
+
+        struct Item {
+            Node* node;
+            bool present;
+            double number;
+            std::string text;
+        };
+
+        std::vector<Item> items;
+        items.reserve(nodes.size());
+        bool numeric = true;
+        for (Node* n : nodes) {
+            Node* v = n->getFirst(path);
+            Item item{n, v != nullptr, 0, {}};
+            if (v) {
+                // Copied, lazily loaded values are let go of with the scope
+                ContentStore::Scope scope;
+                item.text = v->getValue();
+                char* end = nullptr;
+                item.number = strtod(item.text.c_str(), &end);
+                if (item.text.empty() || *end || !std::isfinite(item.number))
+                    numeric = false;
+            }
+            items.push_back(std::move(item));
+        }
+
+        std::stable_sort(items.begin(), items.end(), [numeric, descending](const Item& a, const Item& b) {
+            if (a.present != b.present)
+                return a.present;
+            if (!a.present)
+                return false;
+            const Item& first = descending ? b : a;
+            const Item& second = descending ? a : b;
+            return numeric ? first.number < second.number : first.text < second.text;
+        });
+
+        for (size_t i = 0; i < items.size(); i++)
+            nodes[i] = items[i].node;
+    }
+
+    // Positions of the children of the parent in order
+    const std::vector<uint32_t>& get(Node* parent, std::string_view path, bool descending) {
+
+        // Keeps its memory, so lookups of built indexes do not allocate
+        thread_local Key key;
+        key.parent = parent;
+        key.path.assign(path);
+        key.descending = descending;
+
+        {
+            std::shared_lock lock(mutex);
+            auto it = indexes.find(key);
+            if (it != indexes.end())
+                return *it->second;
+        }
+
+        std::vector<Node*> children;
+        for (size_t i = 0; i < parent->getChildCount(); i++)
+            children.push_back(parent->getChild(i));
+        Sort(children, path, descending);
+
+        auto index = std::make_unique<std::vector<uint32_t>>();
+        index->reserve(children.size());
+        for (Node* n : children)
+            index->push_back((uint32_t)(n - parent->getChild(0)));
+
+        std::unique_lock lock(mutex);
+        auto &slot = indexes[key];
+        if (!slot)
+            slot = std::move(index);
+        return *slot;
+    }
+
+    void clear() {
+        std::unique_lock lock(mutex);
+        indexes.clear();
+    }
+
+    size_t size() const {
+        std::shared_lock lock(mutex);
+        return indexes.size();
+    }
+
+};
+
+// Header of a snapshot file, followed by the content directory path,
+// the list of sources with their state, the tree arena and the search index if the tree has one
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t pathLength;
+    uint64_t sourceCount;
+    uint64_t sourcesSize;
+    uint64_t arenaOffset;
+    uint64_t arenaSize;
+    uint64_t lazyContent;
+    uint64_t searchSize;  // 0 for trees built without search, the index follows the arena
+};
+
 class Tree {
 
 private:
 
+    // File or directory the tree was built from, path is relative to the tree path
+    struct Source {
+        std::string path;
+        int64_t mtime;
+        uint64_t size;
+    };
+
+    static constexpr char snapshotMagic[8] = {'f', 'b', 'l', 'o', 'g', 's', 'n', 'p'};
+    static constexpr uint32_t snapshotVersion = 5;
+
+    std::unique_ptr<char[]> arena;  // built arena
+    void* mapping = nullptr;        // or a mapped snapshot holding it
+    size_t mappingSize = 0;
+    const TreeLayout* currentLayout = nullptr;
     Node* root = nullptr;
+    std::vector<Source> sources;
     std::string path;
+    size_t buildThreads;
+    TemplateCache templates;
+    FragmentCache fragments;
+    SortedIndexes sorted;
+    uint64_t generation = 0;
+
+    // Canonical URI of every page to its node
+    std::unordered_map<std::string, Node*> routes;
+
+    bool lazyContent = false;
+    ContentStore content;
+
+    bool searchable = true;
+    SearchIndex searchIndex;
+
+    // Of the last build, none for snapshots
+    std::vector<TreeStats::Directory> buildTimes;
+    uint64_t buildTime = 0;
+
+    void nextGeneration() {
+        // Unique across all trees of the process
+        static std::atomic<uint64_t> generations{0};
+        generation = ++generations;
+
+        templates.clear();
+        fragments.clear();
+        sorted.clear();
+    }
+
+    void release() {
+        if (mapping)
+            munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+        arena.reset();
+        currentLayout = nullptr;
+        root = nullptr;
+        routes.clear();
+        content.clear();
+        searchIndex.clear();
+        buildTimes.clear();
+        buildTime = 0;
+    }
+
+    void collectSources(const NodeBuilder& builder, const std::string& builderPath) {
+        if (builder.mtime < 0)
+            return;
+        sources.push_back({builderPath, builder.mtime, builder.size});
+        for (const auto &n : builder.sub)
+            collectSources(n, builderPath + '/' + n.key);
+    }
+
+    // A directory takes the time of listing it and of loading the files in it, its sub directories are timed apart
+    void collectBuildTimes(const NodeBuilder& builder, const std::string& builderPath) {
+        if (!builder.directory)
+            return;
+        TreeStats::Directory d{builderPath.empty() ? "/" : builderPath, builder.buildTime, 0};
+        for (const auto &n : builder.sub)
+            if (!n.directory) {
+                d.nanoseconds += n.buildTime;
+                d.files++;
+            }
+        buildTimes.push_back(std::move(d));
+        for (const auto &n : builder.sub)
+            collectBuildTimes(n, builderPath + '/' + n.key);
+    }
+
+    // Adds the URIs made of literal stems only, those getFirst() resolves to the first node in preorder having them.
+    // Others contain regex characters or empty segments and are left to the path walk.
+    void collectRoutes(Node* n, std::string& uri, bool literal) {
+        if (literal)
+            routes.emplace(uri, n);
+
+        size_t length = uri.size();
+        for (size_t i = 0; i < n->getChildCount(); i++) {
+            Node* child = n->getChild(i);
+            std::string_view stem = child->getKey();
+            stem = stem.substr(0, stem.find('.'));
+            if (length > 1)
+                uri += '/';
+            uri += stem;
+            // A '/' in a key would be read as a segment boundary by the path walk
+            collectRoutes(child, uri, literal && !stem.empty() && Utils::IsLiteral(stem) &&
+                                      stem.find('/') == std::string_view::npos);
+            uri.resize(length);
+        }
+    }
+
+    void collectRoutes() {
+        routes.clear();
+        routes.reserve(getNodeCount());
+        std::string uri = "/";
+        collectRoutes(root, uri, true);
+    }
+
+    // A directory is a document made of the words of its txt files and json strings.
+    // A flat collection, several txt or json files with no sub directories, is a document per file instead,
+    // so a search finds the post and not the directory of posts.
+    void collectSearch(Node* directory) {
+        size_t texts = 0, jsons = 0;
+        bool nested = false;
+        for (size_t i = 0; i < directory->getChildCount(); i++) {
+            Node* child = directory->getChild(i);
+            nested |= child->isDirectory();
+            texts += Utils::EndsWith(child->getKey(), ".txt");
+            jsons += Utils::EndsWith(child->getKey(), ".json");
+        }
+        bool collection = !nested && (texts > 1 || jsons > 1);
+
+        if (!collection)
+            searchIndex.addDocument((uint32_t)(directory - root));
+        for (size_t i = 0; i < directory->getChildCount(); i++) {
+            Node* child = directory->getChild(i);
+            if (child->isDirectory())
+                continue;
+            if (collection && (Utils::EndsWith(child->getKey(), ".txt") || Utils::EndsWith(child->getKey(), ".json")))
+                searchIndex.addDocument((uint32_t)(child - root));
+            collectSearch(child, false);
+        }
+        for (size_t i = 0; i < directory->getChildCount(); i++)
+            if (directory->getChild(i)->isDirectory())
+                collectSearch(directory->getChild(i));
+    }
+
+    void collectSearch(Node* n, bool json) {
+        auto key = n->getKey();
+
+        if (json || Utils::EndsWith(key, ".json")) {
+            if (n->flags & Node::text)
+                searchIndex.addText(n->getValue());
+            for (size_t i = 0; i < n->getChildCount(); i++)
+                collectSearch(n->getChild(i), true);
+        }
+
+        else if (Utils::EndsWith(key, ".txt") && (n->flags & Node::lazyValue)) {
+            // Read past the content store, indexing would evict what the pages use
+            std::string file = path, text;
+            n->appendPath(file);
+            if (Utils::ReadFile(file, text))
+                searchIndex.addText(text);
+        }
+
+        else if (Utils::EndsWith(key, ".txt"))
+            searchIndex.addText(n->getValue());
+    }
+
+    void collectSearch() {
+        searchIndex.clear();
+        if (!searchable)
+            return;
+        collectSearch(root);
+        searchIndex.finish();
+    }
+
+    // Checks that every position inside the nodes stays within the arena, once, so lookups need not
+    static bool validateNodes(const TreeLayout& layout, bool lazy) {
+
+        auto nodes = reinterpret_cast<const Node*>(&layout + 1);
+        auto indexes = reinterpret_cast<const char*>(&layout) + layout.indexesOffset;
+        uint64_t count = layout.nodeCount;
+        uint64_t indexesSize = layout.stringsOffset - layout.indexesOffset;
+        uint64_t stringsSize = layout.size - layout.stringsOffset;
+        uint32_t flags = Node::directory | Node::text | (lazy ? Node::lazyValue : 0);
+
+        for (uint64_t i = 0; i < count; i++) {
+            const Node& n = nodes[i];
+
+            // Breadth-first, children come after their parent and point back to it
+            if (n.index != i || (i && n.parent >= i) || n.flags & ~flags ||
+                n.firstChild > count || n.childCount > count - n.firstChild || (n.childCount && n.firstChild <= i) ||
+                n.keyOffset > stringsSize || n.keyLength > stringsSize - n.keyOffset ||
+                n.valueOffset > stringsSize || n.valueLength > stringsSize - n.valueOffset)
+                return false;
+            for (uint32_t c = 0; c < n.childCount; c++)
+                if (nodes[n.firstChild + c].parent != i)
+                    return false;
+
+            if (!n.indexSlots)
+                continue;
+
+            // Probing stops at an empty slot, a full index would never end
+            if ((n.indexSlots & (n.indexSlots - 1)) || n.indexOffset % alignof(Node::IndexSlot) ||
+                n.indexOffset > indexesSize || n.indexSlots > (indexesSize - n.indexOffset) / sizeof(Node::IndexSlot))
+                return false;
+            auto slots = reinterpret_cast<const Node::IndexSlot*>(indexes + n.indexOffset);
+            bool empty = false;
+            for (uint32_t s = 0; s < n.indexSlots; s++) {
+                if (slots[s].child == Node::emptySlot)
+                    empty = true;
+                else if (slots[s].child >= n.childCount)
+                    return false;
+            }
+            if (!empty)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Reads and checks a mapped snapshot, false if it is broken or any source has changed
+    bool validate(const char* data, size_t size, std::vector<Source>& result) const {
+
+        if (size < sizeof(SnapshotHeader))
+            return false;
+        SnapshotHeader header{};
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0 || header.version != snapshotVersion ||
+            header.nodeSize != sizeof(Node) || header.lazyContent != lazyContent)
+            return false;
+
+        size_t pos = sizeof(header);
+        if (header.pathLength > size - pos || std::string_view(data + pos, header.pathLength) != path)
+            return false;
+        pos += header.pathLength;
+
+        if (header.arenaOffset % alignof(Node) || header.arenaOffset > size || header.arenaSize > size - header.arenaOffset ||
+            header.arenaSize < sizeof(TreeLayout) || header.arenaOffset < pos || header.sourcesSize > header.arenaOffset - pos ||
+            header.searchSize != size - header.arenaOffset - header.arenaSize)
+            return false;
+        auto arenaLayout = reinterpret_cast<const TreeLayout*>(data + header.arenaOffset);
+        if (arenaLayout->size != header.arenaSize || arenaLayout->nodeCount == 0 ||
+            arenaLayout->nodeCount > arenaLayout->size / sizeof(Node) ||
+            arenaLayout->indexesOffset != sizeof(TreeLayout) + arenaLayout->nodeCount * sizeof(Node) ||
+            arenaLayout->stringsOffset < arenaLayout->indexesOffset || arenaLayout->stringsOffset > arenaLayout->size ||
+            !validateNodes(*arenaLayout, header.lazyContent != 0))
+            return false;
+
+        // Sources
+
+        size_t end = pos + header.sourcesSize;
+        for (uint64_t i = 0; i < header.sourceCount; i++) {
+            Source source;
+            uint32_t length;
+            if (end - pos < sizeof(source.mtime) + sizeof(source.size) + sizeof(length))
+                return false;
+            memcpy(&source.mtime, data + pos, sizeof(source.mtime));
+            pos += sizeof(source.mtime);
+            memcpy(&source.size, data + pos, sizeof(source.size));
+            pos += sizeof(source.size);
+            memcpy(&length, data + pos, sizeof(length));
+            pos += sizeof(length);
+            if (end - pos < length)
+                return false;
+            source.path.assign(data + pos, length);
+            pos += length;
+            result.push_back(std::move(source));
+        }
+
+        std::atomic<bool> unchanged{true};
+        {
+            ThreadPool pool(buildThreads);
+            size_t chunk = std::max<size_t>(256, result.size() / pool.size() + 1);
+            for (size_t first = 0; first < result.size(); first += chunk)
+                pool.push([&, first]() {
+                    for (size_t i = first; i < std::min(first + chunk, result.size()) && unchanged; i++) {
+                        int64_t mtime;
+                        uint64_t fileSize;
+                        bool directory;
+                        if (!Utils::Stat(path + result[i].path, mtime, fileSize, directory) ||
+                            mtime != result[i].mtime || fileSize != result[i].size)
+                            unchanged = false;
+                    }
+                });
+            pool.wait();
+        }
+
+        return unchanged;
+    }
+
+    // Packs the built nodes into a single allocation
+    void pack(const NodeBuilder& builder) {
+
+        // Breadth-first order keeps the children of every node next to each other
+
+        std::vector<const NodeBuilder*> order = {&builder};
+        std::vector<uint32_t> parents = {0};
+        std::vector<uint32_t> firstChildren;
+        for (size_t i = 0; i < order.size(); i++) {
+            firstChildren.push_back((uint32_t)order.size());
+            for (const auto &n : order[i]->sub) {
+                order.push_back(&n);
+                parents.push_back((uint32_t)i);
+            }
+        }
+
+        // Lay out the string pool, identical keys are stored once
+
+        std::unordered_map<std::string_view, uint64_t> keyOffsets;
+        std::vector<uint64_t> keyOffset(order.size()), valueOffset(order.size());
+        uint64_t stringsSize = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            auto [it, inserted] = keyOffsets.emplace(order[i]->key, stringsSize);
+            if (inserted)
+                stringsSize += order[i]->key.size();
+            keyOffset[i] = it->second;
+            valueOffset[i] = stringsSize;
+            stringsSize += order[i]->value.size();
+        }
+
+        // Lay out the child indexes of large nodes, at most half full
+
+        std::vector<uint32_t> indexSlots(order.size(), 0);
+        std::vector<uint64_t> indexOffset(order.size(), 0);
+        uint64_t indexesSize = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            if (order[i]->sub.size() < Node::indexThreshold)
+                continue;
+            size_t entries = 0;
+            for (const auto &n : order[i]->sub)
+                entries += 1 + std::count(n.key.begin(), n.key.end(), '.');
+            uint32_t slots = 1;
+            while (slots < entries * 2)
+                slots <<= 1;
+            indexSlots[i] = slots;
+            indexOffset[i] = indexesSize;
+            indexesSize += slots * sizeof(Node::IndexSlot);
+        }
+
+        // Fill the arena
+
+        TreeLayout layout{};
+        layout.nodeCount = order.size();
+        layout.indexesOffset = sizeof(TreeLayout) + order.size() * sizeof(Node);
+        layout.stringsOffset = layout.indexesOffset + indexesSize;
+        layout.size = layout.stringsOffset + stringsSize;
+        layout.content = &content;
+
+        arena.reset(new char[layout.size]);
+        memcpy(arena.get(), &layout, sizeof(TreeLayout));
+        auto nodes = reinterpret_cast<Node*>(arena.get() + sizeof(TreeLayout));
+        char* indexes = arena.get() + layout.indexesOffset;
+        char* strings = arena.get() + layout.stringsOffset;
+
+        for (size_t i = 0; i < order.size(); i++) {
+            Node* n = new (nodes + i) Node();
+            const NodeBuilder* b = order[i];
+            n->index = (uint32_t)i;
+            n->parent = parents[i];
+            n->firstChild = firstChildren[i];
+            n->childCount = (uint32_t)b->sub.size();
+            n->keyLength = (uint32_t)b->key.size();
+            n->keyOffset = keyOffset[i];
+            n->valueOffset = valueOffset[i];
+            n->valueLength = b->value.size();
+            n->flags = (b->lazy ? Node::lazyValue : 0) | (b->directory ? Node::directory : 0) | (b->text ? Node::text : 0);
+            n->indexSlots = indexSlots[i];
+            n->indexOffset = indexOffset[i];
+
+            memcpy(strings + keyOffset[i], b->key.data(), b->key.size());
+            memcpy(strings + valueOffset[i], b->value.data(), b->value.size());
+
+            if (!n->indexSlots)
+                continue;
+
+            auto slots = reinterpret_cast<Node::IndexSlot*>(indexes + n->indexOffset);
+            for (uint32_t s = 0; s < n->indexSlots; s++)
+                slots[s] = {0, Node::emptySlot};
+
+            auto insert = [&](std::string_view prefix, uint32_t child) {
+                uint32_t hash = Utils::Hash(prefix);
+                uint32_t s = hash & (n->indexSlots - 1);
+                while (slots[s].child != Node::emptySlot)
+                    s = (s + 1) & (n->indexSlots - 1);
+                slots[s] = {hash, child};
+            };
+
+            for (uint32_t c = 0; c < n->childCount; c++) {
+                std::string_view key = b->sub[c].key;
+                insert(key, c);
+                for (size_t dot = key.find('.'); dot != std::string_view::npos; dot = key.find('.', dot + 1))
+                    insert(key.substr(0, dot), c);
+            }
+        }
+
+        currentLayout = reinterpret_cast<const TreeLayout*>(arena.get());
+        root = nodes;
+    }
 
 public:
 
-    explicit Tree(const std::string& path) {
+    // 0 build threads means one per core
+    explicit Tree(const std::string& path, size_t buildThreads = 0) {
         this->path = path;
+        this->buildThreads = buildThreads;
+        this->content.setRoot(path);
     }
 
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
     ~Tree() {
-        delete root;
+        release();
     }
 
     void build() {
-        delete root;
-        root = new Node();
-        root->build(path);
+        auto start = std::chrono::steady_clock::now();
+        nextGeneration();
+
+        NodeBuilder builder;
+        {
+            ThreadPool pool(buildThreads);
+            pool.push([&]() {
+                builder.build(path, pool, lazyContent);
+            });
+            pool.wait();
+        }
+
+        release();
+        pack(builder);
+
+        sources.clear();
+        collectSources(builder, "");
+
+        collectRoutes();
+        collectSearch();
+
+        collectBuildTimes(builder, "");
+        buildTime = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Writes the built tree with the state of its sources
+    bool save(const std::string& file) const {
+
+        if (!currentLayout)
+            return false;
+
+        std::string sourcesData;
+        for (const auto &source : sources) {
+            auto length = (uint32_t)source.path.size();
+            sourcesData.append(reinterpret_cast<const char*>(&source.mtime), sizeof(source.mtime));
+            sourcesData.append(reinterpret_cast<const char*>(&source.size), sizeof(source.size));
+            sourcesData.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            sourcesData.append(source.path);
+        }
+
+        SnapshotHeader header{};
+        memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+        header.version = snapshotVersion;
+        header.nodeSize = sizeof(Node);
+        header.pathLength = path.size();
+        header.sourceCount = sources.size();
+        header.sourcesSize = sourcesData.size();
+        header.arenaOffset = sizeof(header) + path.size() + sourcesData.size();
+        size_t padding = (alignof(Node) - header.arenaOffset % alignof(Node)) % alignof(Node);
+        header.arenaOffset += padding;
+        header.arenaSize = currentLayout->size;
+        header.lazyContent = lazyContent;
+
+        // Loading the index is a copy, building it again would read all of the content
+        std::string searchData;
+        if (searchIndex.getDocumentCount())
+            searchIndex.save(searchData);
+        header.searchSize = searchData.size();
+
+        // The content store address means nothing to another process
+        TreeLayout layout = *currentLayout;
+        layout.content = nullptr;
+
+        // Replace the old snapshot at once, a running process may have it mapped
+        std::string tmp = file + ".tmp";
+        {
+            std::ofstream os(tmp, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+            os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            os.write(path.data(), (std::streamsize)path.size());
+            os.write(sourcesData.data(), (std::streamsize)sourcesData.size());
+            os.write("\0\0\0\0\0\0\0\0", (std::streamsize)padding);
+            os.write(reinterpret_cast<const char*>(&layout), sizeof(layout));
+            os.write(reinterpret_cast<const char*>(currentLayout + 1), (std::streamsize)(layout.size - sizeof(layout)));
+            os.write(searchData.data(), (std::streamsize)searchData.size());
+            if (!os)
+                return false;
+        }
+        return std::rename(tmp.c_str(), file.c_str()) == 0;
+    }
+
+    // Maps a snapshot written by save() and uses it in place, if none of the sources changed since
+    bool load(const std::string& file) {
+
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        // Writable for the content store address only, the private mapping copies just that page
+        void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+
+        std::vector<Source> loadedSources;
+        if (!validate(static_cast<const char*>(data), (size_t)st.st_size, loadedSources)) {
+            munmap(data, (size_t)st.st_size);
+            return false;
+        }
+
+        nextGeneration();
+        release();
+
+        SnapshotHeader header{};
+        memcpy(&header, data, sizeof(header));
+        mapping = data;
+        mappingSize = (size_t)st.st_size;
+        currentLayout = reinterpret_cast<const TreeLayout*>(static_cast<const char*>(data) + header.arenaOffset);
+        const_cast<TreeLayout*>(currentLayout)->content = &content;
+        root = reinterpret_cast<Node*>(const_cast<TreeLayout*>(currentLayout) + 1);
+        sources = std::move(loadedSources);
+
+        collectRoutes();
+
+        // The saved index is copied, a snapshot saved without one is indexed here
+        std::string_view searchData(static_cast<const char*>(data) + header.arenaOffset + header.arenaSize,
+                                    header.searchSize);
+        if (!searchable || !searchIndex.load(searchData) || !searchIndex.isWithin(getNodeCount()))
+            collectSearch();
+
+        return true;
+    }
+
+    // Reads txt and html contents on first use and keeps at most budget bytes of them,
+    // call before build() or load()
+    void setLazyContent(size_t budget) {
+        lazyContent = true;
+        content.setBudget(budget);
+    }
+
+    bool isLazy() const {
+        return lazyContent;
+    }
+
+    // The search index is built with the tree unless disabled, call before build() or load()
+    void setSearchable(bool searchable) {
+        this->searchable = searchable;
+    }
+
+    const SearchIndex& getSearchIndex() const {
+        return searchIndex;
+    }
+
+    // Directories having all words of the query, best first
+    void search(std::string_view query, size_t limit, std::vector<Node*>& result) const {
+        thread_local std::vector<SearchIndex::Result> found;
+        searchIndex.search(query, limit, found);
+        result.clear();
+        for (const auto &r : found)
+            result.push_back(root + r.id);
+    }
+
+    // Loaded contents of a lazy tree
+    ContentStore& getContent() {
+        return content;
     }
 
     Node* getRoot() {
         return root;
     }
 
+    // Node a normalized request URI is served from, same as getRoot()->getFirst(uri) with one hash lookup.
+    // URIs that are not canonical, like "/blog.category/post\d+", fall back to the path walk.
+    Node* resolve(std::string_view uri) const {
+        if (!root)
+            return nullptr;
+
+        thread_local std::string key;
+        key.assign(uri);
+        auto it = routes.find(key);
+        if (it != routes.end())
+            return it->second;
+
+        // Plain absolute URIs are all in the table
+        if (!uri.empty() && uri[0] == '/' && uri.back() != '/' && uri.find("//") == std::string_view::npos &&
+            Utils::IsLiteral(uri))
+            return nullptr;
+
+        return root->getFirst(uri);
+    }
+
+    size_t getRouteCount() const {
+        return routes.size();
+    }
+
+    size_t getNodeCount() const {
+        return currentLayout ? currentLayout->nodeCount : 0;
+    }
+
+    size_t getArenaSize() const {
+        return currentLayout ? currentLayout->size : 0;
+    }
+
+    // Walks the whole tree, top is the length of the lists of largest subtrees, widest nodes and slowest directories
+    void getStats(TreeStats& stats, size_t top = 10) {
+
+        stats = TreeStats();
+        if (!currentLayout)
+            return;
+
+        const TreeLayout& layout = *currentLayout;
+        size_t count = layout.nodeCount;
+        stats.nodes = count;
+        stats.arenaBytes = layout.size;
+        stats.nodeBytes = count * sizeof(Node);
+        stats.indexBytes = layout.stringsOffset - layout.indexesOffset;
+        stats.keyBytes = layout.size - layout.stringsOffset;
+        if (mapping) {
+            // The whole snapshot file is mapped, in pages
+            auto page = (size_t)sysconf(_SC_PAGESIZE);
+            stats.arenaAllocated = (mappingSize + page - 1) / page * page;
+        }
+        else {
+#ifdef __APPLE__
+            stats.arenaAllocated = malloc_size(arena.get());
+#else
+            stats.arenaAllocated = malloc_usable_size(arena.get());
+#endif
+        }
+
+        // Parents come before their children in the arena, depths are filled forward and subtrees summed backward
+
+        std::vector<uint32_t> depth(count, 0);
+        std::vector<uint64_t> nodes(count, 1), bytes(count, 0);
+        for (size_t i = 0; i < count; i++) {
+            const Node& n = root[i];
+            if (i)
+                depth[i] = depth[n.parent] + 1;
+            if (depth[i] >= stats.depths.size())
+                stats.depths.resize(depth[i] + 1, 0);
+            stats.depths[depth[i]]++;
+
+            size_t bucket = 0;
+            while ((1ull << bucket) <= n.childCount)
+                bucket++;
+            if (bucket >= stats.fanOuts.size())
+                stats.fanOuts.resize(bucket + 1, 0);
+            stats.fanOuts[bucket]++;
+
+            stats.directories += (n.flags & Node::directory) != 0;
+            stats.lazyValues += (n.flags & Node::lazyValue) != 0;
+            stats.indexedNodes += n.indexSlots != 0;
+            stats.keyReferencedBytes += n.keyLength;
+            stats.valueBytes += n.valueLength;
+            bytes[i] = sizeof(Node) + n.keyLength + n.valueLength + n.indexSlots * sizeof(Node::IndexSlot);
+        }
+        // The string pool holds the stored keys and the values
+        stats.keyBytes -= stats.valueBytes;
+        for (size_t i = count - 1; i > 0; i--) {
+            nodes[root[i].parent] += nodes[i];
+            bytes[root[i].parent] += bytes[i];
+        }
+
+        // The root is the whole arena, it is left out of the largest subtrees
+
+        auto firstOf = [&](auto better) {
+            std::vector<uint32_t> order;
+            order.reserve(count);
+            for (uint32_t i = 1; i < count; i++)
+                order.push_back(i);
+            size_t n = std::min(top, order.size());
+            std::partial_sort(order.begin(), order.begin() + (ptrdiff_t)n, order.end(), better);
+            order.resize(n);
+            return order;
+        };
+
+        for (uint32_t i : firstOf([&](uint32_t a, uint32_t b) { return bytes[a] > bytes[b] || (bytes[a] == bytes[b] && a < b); }))
+            stats.largest.push_back({root[i].getPath(), nodes[i], bytes[i]});
+
+        auto children = [&](uint32_t i) { return root[i].childCount; };
+        for (uint32_t i : firstOf([&](uint32_t a, uint32_t b) { return children(a) > children(b) || (children(a) == children(b) && a < b); }))
+            if (children(i))
+                stats.widest.push_back({root[i].getPath(), children(i), root[i].indexSlots != 0});
+
+        // Containers around the arena
+
+        stats.routeBytes = routes.bucket_count() * sizeof(void*) +
+                           routes.size() * (sizeof(void*) + sizeof(decltype(routes)::value_type) + sizeof(size_t));
+        for (const auto &route : routes)
+            if (route.first.capacity() > std::string().capacity())
+                stats.routeBytes += route.first.capacity() + 1;
+        stats.searchBytes = searchIndex.getBytes();
+        stats.contentBytes = lazyContent ? content.getBytes() : 0;
+        stats.residentBytes = Utils::ResidentBytes();
+
+        stats.built = buildTime != 0;
+        stats.buildNanoseconds = buildTime;
+        stats.slowest = buildTimes;
+        size_t n = std::min(top, stats.slowest.size());
+        std::partial_sort(stats.slowest.begin(), stats.slowest.begin() + (ptrdiff_t)n, stats.slowest.end(),
+                          [](const TreeStats::Directory& a, const TreeStats::Directory& b) {
+                              return a.nanoseconds > b.nanoseconds;
+                          });
+        stats.slowest.resize(n);
+    }
+
+    // True if the tree is used in place from a snapshot file
+    bool isMapped() const {
+        return mapping != nullptr;
+    }
+
+    // Changes on every build, content rendered from an older generation is stale
+    uint64_t getGeneration() const {
+        return generation;
+    }
+
+    // Compiled templates of the tree nodes, dropped on every build
+    TemplateCache& getTemplates() {
+        return templates;
+    }
+
+    // Rendered templates that depend on the tree only, dropped on every build
+    FragmentCache& getFragments() {
+        return fragments;
+    }
+
+    // Sorted children for print(), dropped on every build
+    SortedIndexes& getSorted() {
+        return sorted;
+    }
+
 };
 
 
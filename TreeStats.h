@@ -0,0 +1,145 @@
+#ifndef FASTCGI_BLOG_TREESTATS_H
+#define FASTCGI_BLOG_TREESTATS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+
+// Shape and memory of a built tree, filled by Tree::getStats().
+// Sizes of the arena are exact, those of the containers around it are estimated from their capacities.
+
+struct TreeStats {
+
+    struct Subtree {
+        std::string path;
+        uint64_t nodes;
+        uint64_t bytes; // node records, keys as if not shared, values and child indexes of the subtree
+    };
+
+    struct Wide {
+        std::string path;
+        uint64_t children;
+        bool indexed;   // looked up through a child index, the others are scanned
+    };
+
+    // Time Tree::build spent listing a directory and loading the files directly in it
+    struct Directory {
+        std::string path;
+        uint64_t nanoseconds;
+        uint64_t files;
+    };
+
+    uint64_t nodes = 0;
+    uint64_t directories = 0;
+    uint64_t lazyValues = 0;
+    uint64_t indexedNodes = 0;
+
+    std::vector<uint64_t> depths;   // nodes per depth, the root is at 0
+    std::vector<uint64_t> fanOuts;  // nodes per child count: 0, 1, 2-3, 4-7, ...
+
+    // Arena
+    uint64_t arenaBytes = 0;
+    uint64_t arenaAllocated = 0;    // held by the allocation or the mapping
+    uint64_t nodeBytes = 0;
+    uint64_t indexBytes = 0;
+    uint64_t keyBytes = 0;          // stored, identical keys are stored once
+    uint64_t keyReferencedBytes = 0;
+    uint64_t valueBytes = 0;
+
+    // Around the arena
+    uint64_t routeBytes = 0;
+    uint64_t searchBytes = 0;
+    uint64_t contentBytes = 0;
+    uint64_t residentBytes = 0;     // of the whole process
+
+    std::vector<Subtree> largest;
+    std::vector<Wide> widest;
+
+    // Empty for trees loaded from a snapshot
+    bool built = false;
+    uint64_t buildNanoseconds = 0;
+    std::vector<Directory> slowest;
+
+    // Readable report
+    std::string format() const {
+
+        std::string out;
+        char line[256];
+
+        auto add = [&](const char* name, uint64_t bytes) {
+            snprintf(line, sizeof(line), "  %-22s %14llu\n", name, (unsigned long long)bytes);
+            out += line;
+        };
+
+        snprintf(line, sizeof(line), "nodes %llu, directories %llu, lazy values %llu, indexed %llu\n",
+                 (unsigned long long)nodes, (unsigned long long)directories, (unsigned long long)lazyValues,
+                 (unsigned long long)indexedNodes);
+        out += line;
+
+        snprintf(line, sizeof(line), "\n  %-8s %10s\n", "depth", "nodes");
+        out += line;
+        for (size_t i = 0; i < depths.size(); i++) {
+            snprintf(line, sizeof(line), "  %-8zu %10llu\n", i, (unsigned long long)depths[i]);
+            out += line;
+        }
+
+        snprintf(line, sizeof(line), "\n  %-8s %10s\n", "children", "nodes");
+        out += line;
+        for (size_t i = 0; i < fanOuts.size(); i++) {
+            char range[48];
+            if (i < 2)
+                snprintf(range, sizeof(range), "%zu", i);
+            else
+                snprintf(range, sizeof(range), "%llu-%llu", 1ull << (i - 1), (1ull << i) - 1);
+            snprintf(line, sizeof(line), "  %-8s %10llu\n", range, (unsigned long long)fanOuts[i]);
+            out += line;
+        }
+
+        out += "\nbytes\n";
+        add("arena", arenaBytes);
+        add("  node records", nodeBytes);
+        add("  child indexes", indexBytes);
+        add("  keys", keyBytes);
+        add("  keys before sharing", keyReferencedBytes);
+        add("  values", valueBytes);
+        add("  allocator overhead", arenaAllocated > arenaBytes ? arenaAllocated - arenaBytes : 0);
+        add("routes", routeBytes);
+        add("search index", searchBytes);
+        add("lazy content", contentBytes);
+        add("process resident", residentBytes);
+
+        snprintf(line, sizeof(line), "\nlargest subtrees\n  %14s %10s  path\n", "bytes", "nodes");
+        out += line;
+        for (const auto &s : largest) {
+            snprintf(line, sizeof(line), "  %14llu %10llu  ", (unsigned long long)s.bytes, (unsigned long long)s.nodes);
+            out += line + s.path + "\n";
+        }
+
+        snprintf(line, sizeof(line), "\nwidest nodes\n  %14s  path\n", "children");
+        out += line;
+        for (const auto &w : widest) {
+            snprintf(line, sizeof(line), "  %14llu  ", (unsigned long long)w.children);
+            out += line + w.path + (w.indexed ? "" : " (scanned)") + "\n";
+        }
+
+        if (!built) {
+            out += "\nno build times, the tree was loaded from a snapshot\n";
+            return out;
+        }
+
+        snprintf(line, sizeof(line), "\nbuild %.3f s\n", (double)buildNanoseconds / 1e9);
+        out += line;
+        snprintf(line, sizeof(line), "\nslowest directories\n  %14s %10s  path\n", "ms", "files");
+        out += line;
+        for (const auto &d : slowest) {
+            snprintf(line, sizeof(line), "  %14.3f %10llu  ", (double)d.nanoseconds / 1e6, (unsigned long long)d.files);
+            out += line + d.path + "\n";
+        }
+
+        return out;
+    }
+
+};
+
+#endif //FASTCGI_BLOG_TREESTATS_H
@@ -6,19 +6,100 @@
 #define FASTCGI_BLOG_UTILS_H
 
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <vector>
 #include <iomanip>
+#include <sstream>
+#include <regex>
+#include <memory>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <cerrno>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
 
 class Utils {
 
 public:
 
-    static std::vector<std::string> Split(const std::string& s, char delim) {
+    // Moves the next part of s up to the delimiter into part, like getline() does.
+    // Returns false when s is empty, so "a/" has one part and "/" has one empty part.
+    static bool NextSegment(std::string_view& s, std::string_view& part, char delim) {
+        if (s.empty())
+            return false;
+        size_t end = s.find(delim);
+        part = s.substr(0, end);
+        s = end == std::string_view::npos ? std::string_view() : s.substr(end + 1);
+        return true;
+    }
+
+    // Parts of a string as views into it: for (auto part : Utils::SplitView(s, '/'))
+    class SplitView {
+
+    private:
+
+        std::string_view s;
+        char delim;
+
+    public:
+
+        class Iterator {
+
+        private:
+
+            std::string_view rest;
+            std::string_view part;
+            char delim;
+            bool done;
+
+        public:
+
+            Iterator(std::string_view s, char delim) : rest(s), delim(delim) {
+                done = !NextSegment(rest, part, delim);
+            }
+
+            std::string_view operator*() const {
+                return part;
+            }
+
+            Iterator& operator++() {
+                done = !NextSegment(rest, part, delim);
+                return *this;
+            }
+
+            bool operator!=(const Iterator& other) const {
+                return done != other.done;
+            }
+
+        };
+
+        SplitView(std::string_view s, char delim) : s(s), delim(delim) {
+        }
+
+        Iterator begin() const {
+            return {s, delim};
+        }
+
+        Iterator end() const {
+            return {std::string_view(), delim};
+        }
+
+    };
+
+    static std::vector<std::string> Split(std::string_view s, char delim) {
         std::vector<std::string> result;
-        std::stringstream ss(s);
-        std::string item;
-        while (getline(ss, item, delim))
-            result.push_back(item);
+        for (auto part : SplitView(s, delim))
+            result.emplace_back(part);
         return result;
     }
 
@@ -34,6 +115,277 @@ public:
         return v;
     }
 
+    // Request URI reduced to the form that resolves to the same node: the query string,
+    // the fragment and trailing slashes are dropped
+    static std::string NormalizeUri(std::string_view uri) {
+        uri = uri.substr(0, uri.find_first_of("?#"));
+        size_t end = uri.find_last_not_of('/');
+        if (end == std::string_view::npos)
+            return uri.empty() ? std::string() : "/";
+        return std::string(uri.substr(0, end + 1));
+    }
+
+    // Value of a parameter of a query string like "q=a+b&page=2", still encoded, empty if there is none
+    static std::string_view GetQueryParam(std::string_view query, std::string_view name) {
+        for (auto pair : SplitView(query, '&')) {
+            size_t eq = pair.find('=');
+            if (pair.substr(0, eq) == name)
+                return eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+        }
+        return {};
+    }
+
+    // Decodes '+' and %XX escapes of a query string value, malformed escapes are kept as they are
+    static void UrlDecode(std::string_view s, std::string& result) {
+        auto hex = [](char c) {
+            return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        };
+        result.clear();
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '+')
+                result += ' ';
+            else if (s[i] == '%' && i + 2 < s.size() && hex(s[i + 1]) >= 0 && hex(s[i + 2]) >= 0) {
+                result += (char)(hex(s[i + 1]) * 16 + hex(s[i + 2]));
+                i += 2;
+            }
+            else
+                result += s[i];
+        }
+    }
+
+    // Modification time in nanoseconds, size and type of a file, false if it does not exist
+    static bool Stat(const std::string& path, int64_t& mtime, uint64_t& size, bool& directory) {
+
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+
+#ifdef __APPLE__
+        mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        size = (uint64_t)st.st_size;
+        directory = S_ISDIR(st.st_mode);
+        return true;
+    }
+
+    // Resident memory of the process, 0 where /proc is not available
+    static size_t ResidentBytes() {
+        // Proc files have no size, they are read as a stream
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (!f)
+            return 0;
+        size_t pages = 0, resident = 0;
+        int fields = fscanf(f, "%zu %zu", &pages, &resident);
+        fclose(f);
+        return fields == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+    }
+
+    // Reads the whole file with one sized read, returns false if it can not be read
+    static bool ReadFile(const std::string& path, std::string& result) {
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+
+        result.resize((size_t)st.st_size);
+        size_t done = 0;
+        while (done < result.size()) {
+            ssize_t n = read(fd, &result[done], result.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += (size_t)n;
+        }
+        result.resize(done);
+
+        close(fd);
+        return true;
+    }
+
+    // FNV-1a, good enough for short keys
+    static uint32_t Hash(std::string_view s) {
+        uint32_t hash = 2166136261u;
+        for (const auto &c : s) {
+            hash ^= (unsigned char)c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    // XXH64, for page contents
+    static uint64_t Hash64(std::string_view s, uint64_t seed = 0) {
+
+        const uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full, p3 = 0x165667B19E3779F9ull,
+                p4 = 0x85EBCA77C2B2AE63ull, p5 = 0x27D4EB2F165667C5ull;
+
+        auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+        auto read64 = [](const char* p) { uint64_t v; memcpy(&v, p, 8); return v; };
+        auto read32 = [](const char* p) { uint32_t v; memcpy(&v, p, 4); return v; };
+        auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+        auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * p1 + p4; };
+
+        const char* p = s.data();
+        const char* end = p + s.size();
+        uint64_t h;
+
+        if (s.size() >= 32) {
+            uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+        }
+        else
+            h = seed + p5;
+
+        h += s.size();
+
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+        if (p + 4 <= end) {
+            h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+            p += 4;
+        }
+        for (; p < end; p++)
+            h = rotl(h ^ ((unsigned char)*p * p5), 11) * p1;
+
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // True if an If-None-Match header lists one of the entity tags, compared weakly
+    static bool MatchesETag(std::string_view ifNoneMatch, const std::vector<std::string_view>& etags) {
+
+        for (auto &item : Split(ifNoneMatch, ',')) {
+            std::string_view tag = item;
+            size_t begin = tag.find_first_not_of(" \t");
+            if (begin == std::string_view::npos)
+                continue;
+            tag = tag.substr(begin, tag.find_last_not_of(" \t") - begin + 1);
+            if (tag == "*")
+                return true;
+            if (tag.substr(0, 2) == "W/")
+                tag = tag.substr(2);
+            for (const auto &etag : etags)
+                if (!etag.empty() && tag == etag)
+                    return true;
+        }
+
+        return false;
+    }
+
+    static bool EndsWith(std::string_view s, std::string_view suffix) {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // True if s has no regular expression special characters except the allowed ones
+    static bool IsLiteral(std::string_view s, std::string_view allowed = "") {
+        for (const auto &c : std::string_view(R"(^$\.*+?()[]{}|)"))
+            if (allowed.find(c) == std::string::npos && s.find(c) != std::string::npos)
+                return false;
+        return true;
+    }
+
+    // Compiled regular expressions shared by the whole process, null for invalid expressions
+    static std::shared_ptr<const std::regex> GetRegex(std::string_view patternView) {
+
+        static std::unordered_map<std::string, std::shared_ptr<const std::regex>> cache;
+        static std::shared_mutex mutex;
+        static const size_t maxSize = 4096;
+
+        // Keeps its memory, so lookups of cached patterns do not allocate
+        thread_local std::string pattern;
+        pattern.assign(patternView);
+
+        {
+            std::shared_lock lock(mutex);
+            auto it = cache.find(pattern);
+            if (it != cache.end())
+                return it->second;
+        }
+
+        std::shared_ptr<const std::regex> r;
+        try {
+            r = std::make_shared<const std::regex>(pattern);
+        } catch (const std::regex_error&) {
+            r = nullptr;
+        }
+
+        std::unique_lock lock(mutex);
+        // Patterns may come from request URIs, keep the cache bounded
+        if (cache.size() >= maxSize)
+            cache.clear();
+        cache.emplace(pattern, r);
+        return r;
+
+    }
+
+    // Compresses into the gzip format, false on failure
+    static bool Gzip(std::string_view s, std::string& result, int level = Z_DEFAULT_COMPRESSION) {
+
+        z_stream zs{};
+        // 16 selects the gzip wrapper
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        result.resize(deflateBound(&zs, (uLong)s.size()));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(s.data()));
+        zs.avail_in = (uInt)s.size();
+        zs.next_out = reinterpret_cast<Bytef*>(&result[0]);
+        zs.avail_out = (uInt)result.size();
+
+        int r = deflate(&zs, Z_FINISH);
+        result.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        return r == Z_STREAM_END;
+    }
+
+    // True if an Accept-Encoding header allows gzip: "gzip, deflate, br" but not "gzip;q=0"
+    static bool AcceptsGzip(std::string_view acceptEncoding) {
+
+        bool any = false;
+
+        for (const auto &item : Split(acceptEncoding, ',')) {
+            size_t begin = item.find_first_not_of(" \t");
+            if (begin == std::string::npos)
+                continue;
+            size_t end = item.find_first_of(" \t;", begin);
+            std::string coding = item.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+            for (auto &c : coding)
+                c = (char)tolower((unsigned char)c);
+
+            bool allowed = true;
+            size_t q = item.find("q=");
+            if (q != std::string::npos && item.find(';') < q)
+                allowed = strtod(item.c_str() + q + 2, nullptr) > 0;
+
+            if (coding == "gzip" || coding == "x-gzip")
+                return allowed;
+            if (coding == "*")
+                any = allowed;
+        }
+
+        return any;
+    }
+
 };
 
 #endif //FASTCGI_BLOG_UTILS_H
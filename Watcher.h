@@ -0,0 +1,199 @@
+#ifndef FASTCGI_BLOG_WATCHER_H
+#define FASTCGI_BLOG_WATCHER_H
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Watches a directory tree with inotify and calls back once per burst of changes.
+// The callback runs on the watcher thread after no events arrived for `delay`.
+
+class Watcher {
+
+private:
+
+    std::string path;
+    std::chrono::milliseconds delay;
+    std::function<void()> callback;
+
+    int fd = -1;
+    int stopFd = -1;
+    std::unordered_map<int, std::string> watches;
+    std::thread thread;
+    std::vector<std::filesystem::path> ignored;  // canonical
+
+#ifdef __linux__
+
+    static constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                                 IN_DELETE_SELF | IN_MOVE_SELF;
+
+    void addWatches(const std::string& dir) {
+
+        int wd = inotify_add_watch(fd, dir.c_str(), mask | IN_ONLYDIR);
+        if (wd < 0)
+            return;
+        watches[wd] = dir;
+
+        std::error_code ec;
+        for (const auto & item : std::filesystem::directory_iterator(dir, ec)) {
+            std::string itemStr = item.path().filename().c_str();
+            // Hidden items are not part of the tree
+            if (itemStr.empty() || itemStr[0] == '.')
+                continue;
+            if (item.is_directory(ec))
+                addWatches(dir + '/' + itemStr);
+        }
+    }
+
+    // Reads all pending events, returns true if any of them can change the tree
+    bool readEvents() {
+
+        bool changed = false;
+        alignas(inotify_event) char buffer[16384];
+
+        while (true) {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0)
+                break;
+
+            for (char* p = buffer; p < buffer + length; ) {
+                auto event = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_IGNORED) {
+                    watches.erase(event->wd);
+                    continue;
+                }
+
+                std::string name = event->len ? event->name : "";
+                if (!name.empty() && name[0] == '.')
+                    continue;
+
+                auto dir = watches.find(event->wd);
+                if (dir != watches.end() && isIgnored(dir->second, name))
+                    continue;
+
+                changed = true;
+
+                if (dir != watches.end() && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                    addWatches(dir->second + '/' + name);
+            }
+        }
+
+        return changed;
+    }
+
+    bool isIgnored(const std::string& dir, const std::string& name) const {
+        std::error_code ec;
+        for (const auto &file : ignored)
+            if (file.filename() == name && std::filesystem::weakly_canonical(dir, ec) == file.parent_path())
+                return true;
+        return false;
+    }
+
+    // Waits for events, returns false when stopped
+    bool wait(int timeout, bool& timedOut) {
+        pollfd fds[2] = {{fd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        int r = poll(fds, 2, timeout);
+        timedOut = r == 0;
+        return !(fds[1].revents & POLLIN);
+    }
+
+    void run() {
+
+        bool timedOut;
+
+        while (wait(-1, timedOut)) {
+
+            if (!readEvents())
+                continue;
+
+            // Debounce: collect the whole burst, but do not postpone the rebuild forever
+            auto deadline = std::chrono::steady_clock::now() + delay * 10;
+            while (std::chrono::steady_clock::now() < deadline) {
+                if (!wait((int)delay.count(), timedOut))
+                    return;
+                if (timedOut)
+                    break;
+                readEvents();
+            }
+
+            callback();
+        }
+    }
+
+#endif
+
+public:
+
+    Watcher(const std::string& path, std::chrono::milliseconds delay, std::function<void()> callback) {
+        this->path = path;
+        this->delay = delay;
+        this->callback = std::move(callback);
+    }
+
+    ~Watcher() {
+        stop();
+    }
+
+    // Changes of the file do not call back, for files the callback writes itself. Call before start().
+    void ignore(const std::string& file) {
+        std::error_code ec;
+        auto canonical = std::filesystem::weakly_canonical(file, ec);
+        if (!ec)
+            ignored.push_back(canonical);
+    }
+
+    bool start() {
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        if (fd < 0 || stopFd < 0) {
+            stop();
+            return false;
+        }
+
+        addWatches(path);
+        if (watches.empty()) {
+            stop();
+            return false;
+        }
+
+        thread = std::thread(&Watcher::run, this);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        if (thread.joinable()) {
+            uint64_t one = 1;
+            while (write(stopFd, &one, sizeof(one)) < 0 && errno == EINTR);
+            thread.join();
+        }
+        if (fd >= 0)
+            close(fd);
+        if (stopFd >= 0)
+            close(stopFd);
+        fd = stopFd = -1;
+        watches.clear();
+#endif
+    }
+
+};
+
+#endif //FASTCGI_BLOG_WATCHER_H
@@ -0,0 +1,351 @@
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+#include <benchmark/benchmark.h>
+
+#include "Tree.h"
+#include "Generator.h"
+
+// Allocations made by the whole process, reported per iteration
+
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// std::stable_sort takes its buffer from the nothrow form, it must be freed by the delete above
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+// Not inlined, so the compiler does not pair free() with the operator new of the call site
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+class AllocationCounter {
+
+private:
+
+    benchmark::State& state;
+    uint64_t start;
+
+public:
+
+    explicit AllocationCounter(benchmark::State& state) : state(state) {
+        this->start = allocations.load();
+    }
+
+    ~AllocationCounter() {
+        state.counters["allocs"] = benchmark::Counter((double)(allocations.load() - start),
+                                                      benchmark::Counter::kAvgIterations);
+    }
+
+};
+
+// Synthetic site: a blog category with `posts` posts, each post has JSON params nested `depth` levels deep
+// rendered by a chain of `depth` nested templates
+
+class Site {
+
+private:
+
+    static std::string Root() {
+        return std::filesystem::current_path().string() + "/benchsite";
+    }
+
+    static void Write(const std::string& path, const std::string& content) {
+        std::ofstream os(path, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+    }
+
+    static std::string NestedJson(int depth) {
+        if (depth == 0)
+            return R"({"value": "leaf"})";
+        return R"({"value": "level )" + std::to_string(depth) + R"(", "child": )" + NestedJson(depth - 1) + "}";
+    }
+
+public:
+
+    std::string path;
+    int posts;
+    int depth;
+
+    Site(int posts, int depth) {
+        this->posts = posts;
+        this->depth = depth;
+        this->path = Root() + "/" + std::to_string(posts) + "-" + std::to_string(depth);
+
+        std::filesystem::create_directories(path + "/blog.category");
+
+        Write(path + "/params.json", R"({"sitename": "Benchmark"})");
+        Write(path + "/home.html", R"(<!DOCTYPE html>
+<html>
+<head>
+<title><!-- print(/params/sitename) --> - <!-- print(@params/title) --></title>
+</head>
+<body>
+<!-- template(category post) -->
+</body>
+</html>
+)");
+        Write(path + "/category.html", R"(<h1><!-- print(params/name) --></h1>
+<!-- if($@PATH ^blog$) --><ul><!-- print(post\d+\.post postlink) --></ul><!-- endif() -->
+)");
+        Write(path + "/page.html", R"(<ul><!-- print(/blog.category/post\d+\.post postlink sort=-params/title limit=10 page=2) --></ul>
+)");
+        Write(path + "/postlink.html", R"(<li><a href="<!-- print($FULLPATH) -->"><!-- print(params/title) --></a></li>
+)");
+        Write(path + "/post.html", R"(<article><h2><!-- print(@params/title) --></h2>
+<!-- print(@content) -->
+<!-- print(@params/data nest0) --></article>
+)");
+        for (int i = 0; i <= depth; i++)
+            Write(path + "/nest" + std::to_string(i) + ".html",
+                  "<div><!-- print(value) -->" +
+                  (i < depth ? "<!-- print(child nest" + std::to_string(i + 1) + ") -->" : std::string()) +
+                  "</div>\n");
+
+        Write(path + "/blog.category/params.json", R"({"name": "Blog"})");
+
+        std::string content;
+        for (int i = 0; i < 20; i++)
+            content += "<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.</p>\n";
+
+        for (int i = 0; i < posts; i++) {
+            std::string postPath = path + "/blog.category/post" + std::to_string(i) + ".post";
+            std::filesystem::create_directory(postPath);
+            Write(postPath + "/params.json", R"({"title": "Post )" + std::to_string(i) + R"(", "tags": ["a", "b", "c"], "data": )" +
+                                             NestedJson(depth) + "}");
+            Write(postPath + "/content.txt", content);
+        }
+    }
+
+    static Site& Get(int posts, int depth) {
+        static std::map<std::pair<int, int>, Site> sites;
+        auto it = sites.find({posts, depth});
+        if (it == sites.end())
+            it = sites.emplace(std::make_pair(posts, depth), Site(posts, depth)).first;
+        return it->second;
+    }
+
+    static Tree& GetTree(int posts, int depth) {
+        static std::map<std::pair<int, int>, std::unique_ptr<Tree>> trees;
+        auto &tree = trees[{posts, depth}];
+        if (!tree) {
+            tree = std::make_unique<Tree>(Get(posts, depth).path);
+            tree->build();
+        }
+        return *tree;
+    }
+
+    // Data directory of 4 json files with `records` records each
+    static std::string JsonData(int records) {
+        std::string path = Root() + "/json-" + std::to_string(records);
+        if (std::filesystem::exists(path))
+            return path;
+        std::filesystem::create_directories(path);
+        for (int f = 0; f < 4; f++) {
+            std::string json = "[";
+            for (int i = 0; i < records; i++)
+                json += std::string(i ? "," : "") + R"({"id": )" + std::to_string(i) + R"(, "name": "Product \")" +
+                        std::to_string(i) + R"(\"", "price": )" + std::to_string(i % 1000) + R"(.99, "big": 9007199254740993, )" +
+                        R"("tags": ["a", "b", "c"], "active": true, "parent": null})";
+            Write(path + "/data" + std::to_string(f) + ".json", json + "]");
+        }
+        return path;
+    }
+
+    static void RemoveAll() {
+        std::filesystem::remove_all(Root());
+    }
+
+};
+
+// Tree
+
+static void BM_TreeBuild(benchmark::State& state) {
+    auto &site = Site::Get((int)state.range(0), (int)state.range(1));
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        Tree t(site.path);
+        t.build();
+        benchmark::DoNotOptimize(t.getRoot());
+    }
+    state.SetItemsProcessed(state.iterations() * site.posts);
+}
+BENCHMARK(BM_TreeBuild)->ArgsProduct({{100, 1000}, {2, 8}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Peak resident memory is reset through clear_refs, Linux only
+static void ResetPeakMemory() {
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+static double MemoryMB(const std::string& field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, field.size() + 1, field + ":") == 0)
+            return std::strtod(line.c_str() + field.size() + 1, nullptr) / 1024;
+    return 0;
+}
+
+// Build of large json files on one thread, so the peak is the parse of one file. peakMB is over the memory before.
+static void BM_TreeBuildJson(benchmark::State& state) {
+    std::string path = Site::JsonData((int)state.range(0));
+    double peak = 0;
+    size_t arena = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        ResetPeakMemory();
+        double before = MemoryMB("VmRSS");
+        state.ResumeTiming();
+        {
+            Tree t(path, 1);
+            t.setSearchable(false);
+            t.build();
+            arena = t.getArenaSize();
+        }
+        state.PauseTiming();
+        peak = std::max(peak, MemoryMB("VmHWM") - before);
+        state.ResumeTiming();
+    }
+    state.counters["peakMB"] = peak;
+    state.counters["treeMB"] = (double)arena / (1024 * 1024);
+}
+BENCHMARK(BM_TreeBuildJson)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void GetFirst(benchmark::State& state, const std::string& pattern) {
+    auto &tree = Site::GetTree((int)state.range(0), 2);
+    int posts = (int)state.range(0);
+
+    std::vector<std::string> paths;
+    for (int i = 0; i < 64; i++) {
+        std::string path = pattern;
+        path.replace(path.find("{}"), 2, std::to_string(i * 7919 % posts));
+        paths.push_back(path);
+    }
+
+    if (!tree.getRoot()->getFirst(paths[0])) {
+        state.SkipWithError(("Nothing found for " + paths[0]).c_str());
+        return;
+    }
+
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.getRoot()->getFirst(paths[i++ & 63]));
+    }
+}
+
+static void BM_GetLiteral(benchmark::State& state) {
+    GetFirst(state, "/blog/post{}/params/title");
+}
+BENCHMARK(BM_GetLiteral)->Arg(100)->Arg(1000);
+
+static void BM_GetDotted(benchmark::State& state) {
+    GetFirst(state, "/blog.category/post{}.post/params.json/title");
+}
+BENCHMARK(BM_GetDotted)->Arg(100)->Arg(1000);
+
+static void BM_GetRegex(benchmark::State& state) {
+    GetFirst(state, R"(/blog\.category/post{}\.post/params\.json/title)");
+}
+BENCHMARK(BM_GetRegex)->Arg(100)->Arg(1000);
+
+static void BM_Resolve(benchmark::State& state) {
+    auto &tree = Site::GetTree((int)state.range(0), 2);
+    int posts = (int)state.range(0);
+
+    std::vector<std::string> uris;
+    for (int i = 0; i < 64; i++)
+        uris.push_back(Utils::NormalizeUri("/blog/post" + std::to_string(i * 7919 % posts) + "/?utm_source=feed"));
+
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.resolve(uris[i++ & 63]));
+    }
+}
+BENCHMARK(BM_Resolve)->Arg(100)->Arg(1000);
+
+static void BM_GetMultiple(benchmark::State& state) {
+    auto &tree = Site::GetTree((int)state.range(0), 2);
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.getRoot()->get(R"(/blog/post\d+\.post/params/title)"));
+    }
+}
+BENCHMARK(BM_GetMultiple)->Arg(100)->Arg(1000);
+
+// Search: a word of every post and one of a single post, then a word of every post alone
+static void BM_Search(benchmark::State& state) {
+    auto &tree = Site::GetTree((int)state.range(0), 2);
+    std::vector<Node*> results;
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _ : state) {
+        tree.search(i++ & 1 ? "lorem tempor" : "post 7 lorem", 10, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+}
+BENCHMARK(BM_Search)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+// Generator
+
+static void Generate(benchmark::State& state, Tree& tree, const std::string& pagePath,
+                     const std::string& templateName = "home") {
+    Node* page = tree.getRoot()->getFirst(pagePath);
+    if (!page || Generator::Generate(tree, page, tree.getRoot(), templateName, nullptr, "/").empty()) {
+        state.SkipWithError(("Unable to render " + pagePath).c_str());
+        return;
+    }
+
+    size_t bytes = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        auto result = Generator::Generate(tree, page, tree.getRoot(), templateName, nullptr, "/");
+        bytes += result.size();
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed((int64_t)bytes);
+}
+
+static void BM_GenerateList(benchmark::State& state) {
+    Generate(state, Site::GetTree((int)state.range(0), 2), "/blog");
+}
+BENCHMARK(BM_GenerateList)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+// Second page of 10 posts from the sorted index
+static void BM_GeneratePage(benchmark::State& state) {
+    Generate(state, Site::GetTree((int)state.range(0), 2), "/blog", "page");
+}
+BENCHMARK(BM_GeneratePage)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+static void BM_GenerateDetail(benchmark::State& state) {
+    Generate(state, Site::GetTree((int)state.range(0), (int)state.range(1)), "/blog/post1");
+}
+BENCHMARK(BM_GenerateDetail)->ArgsProduct({{100, 1000}, {2, 8}})->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    Site::RemoveAll();
+    return 0;
+}
@@ -5,17 +5,46 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
-
-#include "fcgio.h"
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
 
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 
+#include "FastCgi.h"
 #include "Tree.h"
 #include "Generator.h"
+#include "Output.h"
+#include "ResponseCache.h"
+#include "Watcher.h"
+#include "Metrics.h"
+#include "Prerender.h"
+
+int main(int argc, char** argv) {
 
-int main() {
+    // fblog --prerender <outdir>: render the site to files and exit
+    // fblog --tree-stats: build the tree, report its shape, memory and build times and exit
+
+    std::string prerenderDir;
+    bool treeStats = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--prerender" && i + 1 < argc)
+            prerenderDir = argv[++i];
+        else if (arg == "--tree-stats")
+            treeStats = true;
+        else {
+            std::cerr << "Usage: fblog [--prerender <outdir> | --tree-stats]" << std::endl;
+            return 1;
+        }
+    }
 
     // Load config
 
@@ -24,6 +53,30 @@ int main() {
     std::string templatesPath;
     std::string templateHome = "home";
     std::string template404 = "404";
+    std::string socketPath;
+    int backlog = 1024;
+    int workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    // Requests waiting in each loop, a loop reads new ones between renders and answers those over it with 503 at once
+    size_t queueSize = FcgiServer::batchSize;
+    int queueTimeout = 1000;
+    int retryAfter = 1;
+    RenderBudget renderBudget;
+    renderBudget.time = std::chrono::seconds(10);
+    renderBudget.bytes = 64 * 1024 * 1024;
+    size_t responseCacheSize = 64 * 1024 * 1024;
+    size_t fragmentCacheSize = 32 * 1024 * 1024;
+    bool lazyContent = false;
+    size_t contentCacheSize = 256 * 1024 * 1024;
+    bool search = true;
+    bool watch = false;
+    int watchDelay = 200;
+    size_t outputChunkSize = 16 * 1024;
+    size_t buildThreads = 0;
+    std::string snapshot;
+    std::string metricsUri;
+    std::string treeStatsUri;
+    bool gzip = true;
+    int gzipLevel = 6;
 
     if (std::filesystem::exists(currentPath + "/config.json")) {
         std::ifstream t(currentPath + "/config.json");
@@ -39,53 +92,316 @@ int main() {
                 templateHome = json.GetObject().FindMember("templateHome")->value.GetString();
             if (json.GetObject().HasMember("template404"))
                 template404 = json.GetObject().FindMember("template404")->value.GetString();
+            if (json.GetObject().HasMember("socket"))
+                socketPath = json.GetObject().FindMember("socket")->value.GetString();
+            if (json.GetObject().HasMember("backlog"))
+                backlog = json.GetObject().FindMember("backlog")->value.GetInt();
+            if (json.GetObject().HasMember("workers"))
+                workers = std::max(1, json.GetObject().FindMember("workers")->value.GetInt());
+            if (json.GetObject().HasMember("queueSize"))
+                queueSize = json.GetObject().FindMember("queueSize")->value.GetUint64();
+            if (json.GetObject().HasMember("queueTimeout"))
+                queueTimeout = json.GetObject().FindMember("queueTimeout")->value.GetInt();
+            if (json.GetObject().HasMember("retryAfter"))
+                retryAfter = json.GetObject().FindMember("retryAfter")->value.GetInt();
+            if (json.GetObject().HasMember("renderTimeout"))
+                renderBudget.time = std::chrono::milliseconds(json.GetObject().FindMember("renderTimeout")->value.GetUint64());
+            if (json.GetObject().HasMember("renderMaxBytes"))
+                renderBudget.bytes = json.GetObject().FindMember("renderMaxBytes")->value.GetUint64();
+            if (json.GetObject().HasMember("renderMaxDepth"))
+                renderBudget.depth = json.GetObject().FindMember("renderMaxDepth")->value.GetUint64();
+            if (json.GetObject().HasMember("responseCacheSize"))
+                responseCacheSize = json.GetObject().FindMember("responseCacheSize")->value.GetUint64();
+            if (json.GetObject().HasMember("fragmentCacheSize"))
+                fragmentCacheSize = json.GetObject().FindMember("fragmentCacheSize")->value.GetUint64();
+            if (json.GetObject().HasMember("lazyContent"))
+                lazyContent = json.GetObject().FindMember("lazyContent")->value.GetBool();
+            if (json.GetObject().HasMember("contentCacheSize"))
+                contentCacheSize = json.GetObject().FindMember("contentCacheSize")->value.GetUint64();
+            if (json.GetObject().HasMember("search"))
+                search = json.GetObject().FindMember("search")->value.GetBool();
+            if (json.GetObject().HasMember("buildThreads"))
+                buildThreads = json.GetObject().FindMember("buildThreads")->value.GetUint();
+            if (json.GetObject().HasMember("outputChunkSize"))
+                outputChunkSize = json.GetObject().FindMember("outputChunkSize")->value.GetUint64();
+            if (json.GetObject().HasMember("watch"))
+                watch = json.GetObject().FindMember("watch")->value.GetBool();
+            if (json.GetObject().HasMember("watchDelay"))
+                watchDelay = json.GetObject().FindMember("watchDelay")->value.GetInt();
+            if (json.GetObject().HasMember("snapshot"))
+                snapshot = json.GetObject().FindMember("snapshot")->value.GetString();
+            if (json.GetObject().HasMember("metricsUri"))
+                metricsUri = Utils::NormalizeUri(json.GetObject().FindMember("metricsUri")->value.GetString());
+            if (json.GetObject().HasMember("treeStatsUri"))
+                treeStatsUri = Utils::NormalizeUri(json.GetObject().FindMember("treeStatsUri")->value.GetString());
+            if (json.GetObject().HasMember("gzip"))
+                gzip = json.GetObject().FindMember("gzip")->value.GetBool();
+            if (json.GetObject().HasMember("gzipLevel"))
+                gzipLevel = json.GetObject().FindMember("gzipLevel")->value.GetInt();
+        }
+    }
+
+    // Load tree, requests keep the tree they started with and reloads publish a new one
+
+    // The snapshot is used as is while the content has not changed since it was written
+
+    // Trees are configured the same way at startup and on every reload
+    auto newTree = [&]() {
+        auto t = std::make_shared<Tree>(dir, buildThreads);
+        t->getFragments().setMaxBytes(fragmentCacheSize);
+        if (lazyContent)
+            t->setLazyContent(contentCacheSize);
+        t->setSearchable(search);
+        return t;
+    };
+
+    auto tree = newTree();
+
+    if (treeStats) {
+        // Always built, a snapshot has no build times
+        tree->build();
+        TreeStats stats;
+        tree->getStats(stats);
+        std::cout << stats.format();
+        return 0;
+    }
+
+    if (snapshot.empty() || !tree->load(snapshot)) {
+        tree->build();
+        if (!snapshot.empty() && !tree->save(snapshot))
+            std::cerr << "Unable to save snapshot " << snapshot << std::endl;
+    }
+
+    if (!prerenderDir.empty()) {
+        Prerender::Settings settings;
+        settings.templateHome = templateHome;
+        settings.template404 = template404;
+        settings.templatesPath = templatesPath;
+        settings.threads = buildThreads;
+        settings.gzip = gzip;
+        settings.gzipLevel = gzipLevel;
+
+        auto result = Prerender::Run(*tree, prerenderDir, settings);
+
+        for (const auto &uri : result.skipped)
+            std::cout << "Skipped request dependent page " << uri << std::endl;
+        for (const auto &uri : result.failed)
+            std::cerr << "Unable to write page " << uri << std::endl;
+        std::cout << "Rendered " << result.pages << " pages in " << result.seconds << " s, "
+                  << (result.seconds > 0 ? (double)result.pages / result.seconds : 0) << " pages/s" << std::endl;
+
+        return result.failed.empty() ? 0 : 1;
+    }
+
+    Watcher watcher(dir, std::chrono::milliseconds(watchDelay), [&]() {
+        auto built = newTree();
+        built->build();
+        std::atomic_store(&tree, built);
+        if (!snapshot.empty())
+            built->save(snapshot);
+    });
+    // Saving the snapshot must not count as a change, inside the content directory it would rebuild forever
+    if (!snapshot.empty()) {
+        watcher.ignore(snapshot);
+        watcher.ignore(snapshot + ".tmp");
+    }
+    if (watch && !watcher.start())
+        std::cerr << "Unable to watch " << dir << ", content will not be reloaded" << std::endl;
+
+    // Start event loops, one per worker, each one accepts and serves its own connections on the shared socket
+
+    int socket = 0;
+    if (!socketPath.empty()) {
+        socket = FcgiServer::Listen(socketPath, backlog);
+        if (socket < 0) {
+            std::cerr << "Unable to open socket " << socketPath << std::endl;
+            return 1;
         }
     }
 
-    // Load tree
+    ResponseCache cache(responseCacheSize);
+    // Never a normalized URI, those lose the query string
+    const std::string notFoundKey = "?404";
+
+    // Smaller pages gain nothing from compression
+    const size_t gzipMinSize = 256;
+    Metrics metrics;
+
+    FcgiServer server(socket, (size_t)workers, [&](FcgiRequest& request) {
 
-    Tree t(dir);
-    t.build();
+        // Reused for every page rendered by this loop
+        thread_local Output page;
+        thread_local FcgiOutput stream(outputChunkSize);
 
-    std::streambuf * cin_streambuf  = std::cin.rdbuf();
-    std::streambuf * cout_streambuf = std::cout.rdbuf();
-    std::streambuf * cerr_streambuf = std::cerr.rdbuf();
+        auto start = std::chrono::steady_clock::now();
 
-    FCGX_Request request;
+        std::shared_ptr<Tree> t = std::atomic_load(&tree);
 
-    FCGX_Init();
-    FCGX_InitRequest(&request, 0, 0);
+        std::string uri = Utils::NormalizeUri(request.getParam("REQUEST_URI"));
 
-    while (FCGX_Accept_r(&request) == 0) {
-        fcgi_streambuf cin_fcgi_streambuf(request.in);
-        fcgi_streambuf cout_fcgi_streambuf(request.out);
-        fcgi_streambuf cerr_fcgi_streambuf(request.err);
+        // Internal metrics, not counted themselves
+        if (!metricsUri.empty() && uri == metricsUri) {
+            std::string text = metrics.format();
+            if (t->isLazy()) {
+                // Counted per tree, they start over on reload
+                ContentStore& content = t->getContent();
+                text += "# TYPE fblog_content_loads_total counter\n";
+                text += "fblog_content_loads_total " + std::to_string(content.getLoads()) + "\n";
+                text += "# TYPE fblog_content_evictions_total counter\n";
+                text += "fblog_content_evictions_total " + std::to_string(content.getEvictions()) + "\n";
+                text += "# TYPE fblog_content_bytes gauge\n";
+                text += "fblog_content_bytes " + std::to_string(content.getBytes()) + "\n";
+            }
+            request.write("Status: 200 OK\r\nContent-type: text/plain; version=0.0.4\r\n\r\n", text);
+            return;
+        }
 
-        std::cin.rdbuf(&cin_fcgi_streambuf);
-        std::cout.rdbuf(&cout_fcgi_streambuf);
-        std::cerr.rdbuf(&cerr_fcgi_streambuf);
+        // Internal report of the tree serving this request, it walks every node
+        if (!treeStatsUri.empty() && uri == treeStatsUri) {
+            TreeStats stats;
+            t->getStats(stats);
+            request.write("Status: 200 OK\r\nContent-type: text/plain\r\n\r\n", stats.format());
+            return;
+        }
 
-        std::string uri = FCGX_GetParam("REQUEST_URI", request.envp);
+        auto response = cache.get(uri, t->getGeneration());
 
+        std::string cacheKey = uri;
         std::string currentTemplate = templateHome;
-        std::string status = "Status: 200 OK";
-        auto n = t.getRoot()->getFirst(uri);
-        if (!n) {
-            n = t.getRoot();
-            currentTemplate = template404;
-            status = "Status: 404 Not Found";
+        int code = 200;
+        std::string status = "Status: 200 OK\r\n";
+        std::string headers = "Content-type: text/html\r\n";
+        Node* n = nullptr;
+
+        if (!response || response->requestDependent) {
+            auto lookupStart = std::chrono::steady_clock::now();
+            n = t->resolve(uri);
+            metrics.lookupTime.record(lookupStart);
+            if (!n) {
+                n = t->getRoot();
+                currentTemplate = template404;
+                code = 404;
+                status = "Status: 404 Not Found\r\n";
+                // Unknown URIs share one cached page, requests for random paths do not push pages out of the cache
+                cacheKey = notFoundKey;
+                response = cache.get(cacheKey, t->getGeneration());
+            }
         }
 
-        std::string result = Generator::Generate(n, t.getRoot(), currentTemplate, &request, templatesPath);
-        std::cout << status << "\r\n"
-                  << "Content-type: text/html\r\n"
-                  << "\r\n"
-                  << result;
-    }
+        if (!response || response->requestDependent) {
+
+            if (response || !responseCacheSize) {
+                // Nothing to cache, stream the page as it is rendered
+
+                std::string head = status + headers + "\r\n";
+                request.write(head);
+
+                stream.setRequest(&request);
+                Generator::RenderInfo info;
+                Generator::Generate(*t, n, t->getRoot(), currentTemplate, &request, templatesPath, stream, &info,
+                                    &metrics, renderBudget);
+                stream.flush();
+                if (info.aborted) {
+                    // The head is out already, the response is ended as failed so it is not passed on as a whole page
+                    request.fail();
+                    metrics.countAbortedRender();
+                }
+
+                metrics.countResponse(code, head.size() + stream.getSize());
+                metrics.requestTime.record(start);
+                return;
+            }
+
+            // Render into the loop buffer and keep the page if it does not depend on the request
+
+            page.clear();
+            Generator::RenderInfo info;
+            Generator::Generate(*t, n, t->getRoot(), currentTemplate, &request, templatesPath, page, &info, &metrics,
+                                renderBudget);
+
+            if (info.aborted) {
+                // Incomplete, neither sent nor cached, the next request renders it again
+                std::string_view head = "Status: 500 Internal Server Error\r\nContent-type: text/plain\r\n\r\n";
+                std::string_view body = "Render budget exceeded\n";
+                request.write(head, body);
+
+                metrics.countAbortedRender();
+                metrics.countResponse(500, head.size() + body.size());
+                metrics.requestTime.record(start);
+                return;
+            }
+
+            auto rendered = std::make_shared<ResponseCache::Response>();
+            rendered->status = status;
+            rendered->headers = headers;
+            rendered->body = page.getBuffer();
+
+            // Compressed once here, cached pages are served in the encoding the client accepts
+            if (gzip && rendered->body.size() >= gzipMinSize &&
+                Utils::Gzip(rendered->body, rendered->gzipBody, gzipLevel) &&
+                rendered->gzipBody.size() < rendered->body.size())
+                rendered->headers += "Vary: Accept-Encoding\r\n";
+            else
+                rendered->gzipBody.clear();
+
+            // Hashed once as well, a revalidation of a cached page costs a lookup only
+            if (code == 200) {
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)Utils::Hash64(rendered->body));
+                rendered->etag = std::string("\"") + hash + "\"";
+                if (!rendered->gzipBody.empty())
+                    rendered->gzipETag = std::string("\"") + hash + "-gzip\"";
+            }
+
+            if (info.requestDependent) {
+                auto marker = std::make_shared<ResponseCache::Response>();
+                marker->requestDependent = true;
+                cache.put(cacheKey, t->getGeneration(), marker);
+            }
+            else
+                cache.put(cacheKey, t->getGeneration(), rendered);
+
+            response = rendered;
+        }
+
+        bool gzipped = !response->gzipBody.empty() &&
+                       Utils::AcceptsGzip(request.getParam("HTTP_ACCEPT_ENCODING"));
+        const std::string& body = gzipped ? response->gzipBody : response->body;
+        const std::string& etag = gzipped ? response->gzipETag : response->etag;
+
+        // Only the tag of the variant being served, a gzip tag does not validate the plain page
+        if (!etag.empty() && Utils::MatchesETag(request.getParam("HTTP_IF_NONE_MATCH"), {etag})) {
+            // The client has the page already
+            std::string head = "Status: 304 Not Modified\r\n" + response->headers + "ETag: " + etag + "\r\n\r\n";
+            request.write(head);
+
+            metrics.countResponse(304, head.size());
+            metrics.requestTime.record(start);
+            return;
+        }
+
+        std::string head = response->status + response->headers + (gzipped ? "Content-Encoding: gzip\r\n" : "") +
+                           (etag.empty() ? "" : "ETag: " + etag + "\r\n") + "\r\n";
+        // Headers and the cached body go out in one write
+        request.write(head, body);
+
+        // "Status: 200 OK"
+        metrics.countResponse(std::atoi(response->status.c_str() + 8), head.size() + body.size());
+        metrics.requestTime.record(start);
+
+    });
+
+    // Over the queue size requests are turned away at once, before they wait behind the ones rendering,
+    // and so are those that waited longer than the queue timeout
+    std::string overloadHead = "Status: 503 Service Unavailable\r\nRetry-After: " + std::to_string(retryAfter) +
+                               "\r\nContent-type: text/plain\r\n\r\n";
+    server.setQueueLimit(queueSize, std::chrono::milliseconds(queueTimeout), [&](FcgiRequest& request) {
+        std::string_view body = "Service Unavailable\n";
+        request.write(overloadHead, body);
+        metrics.countResponse(503, overloadHead.size() + body.size());
+    });
 
-    std::cin.rdbuf(cin_streambuf);
-    std::cout.rdbuf(cout_streambuf);
-    std::cerr.rdbuf(cerr_streambuf);
+    server.run();
 
     return 0;
 }
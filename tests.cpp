@@ -4,17 +4,65 @@
 
 #include <filesystem>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <regex>
+#include <new>
 
 #include "gtest/gtest.h"
 
 #include "Tree.h"
 #include "Generator.h"
+#include "ResponseCache.h"
+#include "Watcher.h"
+#include "Output.h"
+#include "Metrics.h"
+#include "Prerender.h"
+#ifdef __linux__
+#include "FastCgi.h"
+#endif
+
+// Heap allocations of the process, for tests that check a code path does not allocate
+
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// std::stable_sort takes its buffer from the nothrow form, it must be freed by the delete above
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+// Not inlined, so the compiler does not pair free() with the operator new of the call site
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
 
 int main(int argc, char *argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
 
+// Path and value of every node under n in preorder, one per line
+static std::string Dump(Node* n) {
+    std::string result = n->getPath() + "=" + std::string(n->getValue()) + "\n";
+    for (size_t i = 0; i < n->getChildCount(); i++)
+        result += Dump(n->getChild(i));
+    return result;
+}
+
 TEST(Tree, Build) {
 
     std::string currentPath = std::filesystem::current_path().string();
@@ -66,9 +114,13 @@ TEST(Tree, BuildFromJson) {
             "bar",
             123.45
         ]
-    }
+    },
+    "numbers": [9007199254740993, -5, 1e3, 0.1, true, null, "a\"bé"]
 })";
     os.close();
+    os.open(currentPath + "/testtree/broken.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"a": "b", "c": [1, 2)";
+    os.close();
 
     Tree t(currentPath + "/testtree");
     t.build();
@@ -81,6 +133,23 @@ TEST(Tree, BuildFromJson) {
     ASSERT_NE(n, nullptr);
     EXPECT_EQ(n->getValue(), "bar");
 
+    // Numbers are kept as written
+    n = t.getRoot()->getFirst("/testjson.json/object/foo/1");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(n->getValue(), "123.45");
+    std::vector<std::string> values;
+    for (size_t i = 0; i < 7; i++) {
+        n = t.getRoot()->getFirst("/testjson.json/numbers/" + std::to_string(i));
+        ASSERT_NE(n, nullptr);
+        values.emplace_back(n->getValue());
+    }
+    EXPECT_EQ(values, std::vector<std::string>({"9007199254740993", "-5", "1e3", "0.1", "true", "", "a\"b\xC3\xA9"}));
+
+    // Broken files have no nodes
+    n = t.getRoot()->getFirst("/broken.json");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(t.getRoot()->getFirst("/broken.json/a"), nullptr);
+
     std::filesystem::remove_all(currentPath + "/testtree");
 
 }
@@ -361,8 +430,1710 @@ TEST(Generator, PathVariable) {
     auto n = t.getRoot();
 
     EXPECT_EQ(Generator::Generate(n, n, "home", nullptr, "/"),
-              R"(/obj3/obj2/obj1)");
+              R"(/obj1/obj2/obj3)");
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Generator, CompiledTemplates) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    // Create home template with an unknown tag and a malformed condition
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<p><!-- unknown(a b) --><!-- print(params/title) --></p><!-- if(params/title) -->!<!-- endif() -->)";
+    os.close();
+
+    os.open(currentPath + "/testtree/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "hello"})";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    auto expected = R"(<p><!-- unknown(a b) -->hello</p><!-- if(params/title) -->!)";
+    EXPECT_EQ(Generator::Generate(t.getRoot(), t.getRoot(), "home", nullptr, "/"), expected);
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/"), expected);
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/"), expected);
+    EXPECT_EQ(t.getTemplates().size(), 1);
+
+    // Compiled templates are dropped on rebuild
+
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<h1><!-- print(params/title) --></h1>)";
+    os.close();
+
+    t.build();
+
+    EXPECT_EQ(t.getTemplates().size(), 0);
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/"), "<h1>hello</h1>");
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Tree, GetIndexed) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/posts");
+
+    std::ofstream os;
+    for (int i = 0; i < 20; i++) {
+        os.open(currentPath + "/testtree/posts/post" + std::to_string(i) + ".post.txt", std::ofstream::out | std::ofstream::trunc);
+        os << "post " << i;
+        os.close();
+    }
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    // Literal, stem and dotted paths go through the index
+    auto n = t.getRoot()->getFirst("/posts/post7");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(n->getValue(), "post 7");
+    n = t.getRoot()->getFirst("/posts/post7.post");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(n->getValue(), "post 7");
+    n = t.getRoot()->getFirst("/posts/post7.post.txt");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(n->getValue(), "post 7");
+    EXPECT_EQ(t.getRoot()->getFirst("/posts/post"), nullptr);
+
+    // Dots match any character like in regular expressions
+    n = t.getRoot()->getFirst("/posts/post7.post.tx.");
+    ASSERT_NE(n, nullptr);
+    EXPECT_EQ(n->getValue(), "post 7");
+
+    // Regular expressions
+    EXPECT_EQ(t.getRoot()->get("/posts/post1\\d\\..*").size(), 10);
+    EXPECT_EQ(t.getRoot()->get("posts/.*").size(), 20);
+
+    // Invalid regular expressions match nothing
+    EXPECT_TRUE(t.getRoot()->get("/posts/post(").empty());
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(ResponseCache, EvictionAndGenerations) {
+
+    auto response = [](const std::string& body) {
+        auto r = std::make_shared<ResponseCache::Response>();
+        r->body = body;
+        return r;
+    };
+
+    ResponseCache cache(30);
+
+    cache.put("/a", 1, response("0123456789"));
+    cache.put("/b", 1, response("0123456789"));
+    ASSERT_NE(cache.get("/a", 1), nullptr);
+    EXPECT_EQ(cache.get("/a", 1)->body, "0123456789");
+
+    // "/b" is the least recently used one
+    cache.put("/c", 1, response("0123456789"));
+    EXPECT_EQ(cache.get("/b", 1), nullptr);
+    EXPECT_NE(cache.get("/a", 1), nullptr);
+    EXPECT_NE(cache.get("/c", 1), nullptr);
+    EXPECT_LE(cache.getBytes(), 30);
+
+    // Responses larger than the whole budget are not stored
+    cache.put("/d", 1, response(std::string(100, 'x')));
+    EXPECT_EQ(cache.get("/d", 1), nullptr);
+
+    // A new tree generation drops everything, stale renders are ignored
+    EXPECT_EQ(cache.get("/a", 2), nullptr);
+    EXPECT_EQ(cache.size(), 0);
+    cache.put("/a", 1, response("old"));
+    EXPECT_EQ(cache.get("/a", 2), nullptr);
+
+    EXPECT_EQ(Utils::NormalizeUri("/blog/post/"), "/blog/post");
+    EXPECT_EQ(Utils::NormalizeUri("///"), "/");
+    EXPECT_EQ(Utils::NormalizeUri("/blog/post/?page=2"), "/blog/post");
+    EXPECT_EQ(Utils::NormalizeUri("/?utm_source=feed#top"), "/");
+    EXPECT_EQ(Utils::NormalizeUri("?a"), "");
+
+}
+
+TEST(Generator, RequestDependent) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<!-- print($PATH) -->)";
+    os.close();
+    os.open(currentPath + "/testtree/query.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<!-- print($QUERY_STRING) -->)";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    // A request without variables
+    struct : RequestParams {
+        std::string_view getParam(std::string_view) const override {
+            return {};
+        }
+    } request;
+
+    Generator::RenderInfo info;
+    Generator::Generate(t, t.getRoot(), t.getRoot(), "home", &request, "/", &info);
+    EXPECT_FALSE(info.requestDependent);
+
+    Generator::Generate(t, t.getRoot(), t.getRoot(), "query", &request, "/", &info);
+    EXPECT_TRUE(info.requestDependent);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Watcher, Debounce) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/posts");
+
+    std::atomic<int> rebuilds{0};
+    Watcher watcher(currentPath + "/testtree", std::chrono::milliseconds(100), [&]() {
+        rebuilds++;
+    });
+    watcher.ignore(currentPath + "/testtree/snapshot");
+    watcher.ignore(currentPath + "/testtree/snapshot.tmp");
+    ASSERT_TRUE(watcher.start());
+
+    // A burst of changes, including files in a new directory, triggers one rebuild
+
+    std::ofstream os;
+    for (int i = 0; i < 50; i++) {
+        os.open(currentPath + "/testtree/posts/" + std::to_string(i) + ".txt", std::ofstream::out | std::ofstream::trunc);
+        os << i;
+        os.close();
+    }
+    std::filesystem::create_directory(currentPath + "/testtree/drafts");
+    os.open(currentPath + "/testtree/drafts/draft.txt", std::ofstream::out | std::ofstream::trunc);
+    os.close();
+
+    for (int i = 0; i < 200 && rebuilds == 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(rebuilds, 1);
+
+    // Hidden files are not part of the tree
+
+    os.open(currentPath + "/testtree/.hidden", std::ofstream::out | std::ofstream::trunc);
+    os.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(rebuilds, 1);
+
+    // Neither are ignored files, written like Tree::save() writes a snapshot
+    std::string snapshot = currentPath + "/testtree/posts/../snapshot";
+    os.open(snapshot + ".tmp", std::ofstream::out | std::ofstream::trunc);
+    os << "snapshot";
+    os.close();
+    std::filesystem::rename(snapshot + ".tmp", snapshot);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(rebuilds, 1);
+
+    // The new directory is watched too
+
+    os.open(currentPath + "/testtree/drafts/draft.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "changed";
+    os.close();
+    for (int i = 0; i < 200 && rebuilds == 1; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(rebuilds, 2);
+
+    watcher.stop();
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Tree, Arena) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::ofstream os;
+    os.open(currentPath + "/testtree/items.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"([{"title": "a"}, {"title": "b"}, {"title": "c"}])";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    // Root, items.json, 3 items and 3 titles
+    EXPECT_EQ(t.getNodeCount(), 8);
+
+    auto items = t.getRoot()->getFirst("items");
+    ASSERT_NE(items, nullptr);
+    EXPECT_EQ(items->getParent(), t.getRoot());
+    EXPECT_EQ(t.getRoot()->getParent(), nullptr);
+    ASSERT_EQ(items->getChildCount(), 3);
+
+    for (size_t i = 0; i < items->getChildCount(); i++) {
+        auto item = items->getChild(i);
+        EXPECT_EQ(item->getParent(), items);
+        EXPECT_EQ(item->getKey(), std::to_string(i));
+        EXPECT_EQ(item->getFirst("title")->getValue(), std::string(1, 'a' + i));
+        EXPECT_EQ(item->getFirst("title")->getRoot(), t.getRoot());
+    }
+
+    // Repeated keys are stored once
+    EXPECT_EQ(items->getChild(0)->getChild(0)->getKey().data(), items->getChild(2)->getChild(0)->getKey().data());
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Generator, StreamOutput) {
+
+    class ChunkOutput : public Output {
+    public:
+        std::vector<std::string> chunks;
+        explicit ChunkOutput(size_t chunkSize) : Output(chunkSize) {}
+    protected:
+        void write(std::string_view chunk) override {
+            chunks.emplace_back(chunk);
+        }
+    };
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/items");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<ul><!-- print(items/.* item) --></ul>)";
+    os.close();
+    os.open(currentPath + "/testtree/item.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<li><!-- print(text) --></li>)";
+    os.close();
+    for (int i = 0; i < 20; i++) {
+        os.open(currentPath + "/testtree/items/" + std::to_string(i) + ".json", std::ofstream::out | std::ofstream::trunc);
+        os << R"({"text": "item text number )" << i << R"("})";
+        os.close();
+    }
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    std::string expected = Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/");
+
+    ChunkOutput out(64);
+    Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/", out);
+
+    // Chunks are written while rendering, the tail stays in the buffer until flushed
+    EXPECT_GT(out.chunks.size(), 5);
+    for (const auto &chunk : out.chunks)
+        EXPECT_GE(chunk.size(), 64);
+    EXPECT_LT(out.getBuffer().size(), 64);
+
+    out.flush();
+    std::string streamed;
+    for (const auto &chunk : out.chunks)
+        streamed += chunk;
+    EXPECT_EQ(streamed, expected);
+    EXPECT_TRUE(out.getBuffer().empty());
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Tree, ParallelBuild) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    for (int i = 0; i < 10; i++) {
+        std::string dir = currentPath + "/testtree/dir" + std::to_string(9 - i);
+        std::filesystem::create_directory(dir);
+        for (int j = 0; j < 10; j++) {
+            os.open(dir + "/" + std::to_string(j) + (j % 2 ? ".txt" : ".json"), std::ofstream::out | std::ofstream::trunc);
+            if (j % 2)
+                os << "text " << i << " " << j;
+            else
+                os << R"({"a": [1, 2, {"b": "c"}], "d": ")" << i << j << R"("})";
+            os.close();
+        }
+    }
+
+    Tree t1(currentPath + "/testtree", 1);
+    t1.build();
+    Tree t4(currentPath + "/testtree", 4);
+    t4.build();
+
+    EXPECT_EQ(t1.getNodeCount(), 1 + 10 * (1 + 5 * 7 + 5));
+    EXPECT_EQ(Dump(t1.getRoot()), Dump(t4.getRoot()));
+
+    // Children are sorted by name
+    EXPECT_EQ(t4.getRoot()->getChild(0)->getKey(), "dir0");
+    EXPECT_EQ(t4.getRoot()->getChild(9)->getKey(), "dir9");
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Tree, Snapshot) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/posts");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/posts/1.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "First", "tags": ["a", "b"]})";
+    os.close();
+    os.open(currentPath + "/testtree/posts/2.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "Second";
+    os.close();
+
+    std::string snapshot = currentPath + "/testsnapshot";
+
+    Tree t1(currentPath + "/testtree");
+    t1.build();
+    EXPECT_TRUE(t1.save(snapshot));
+
+    Tree t2(currentPath + "/testtree");
+    EXPECT_TRUE(t2.load(snapshot));
+    EXPECT_TRUE(t2.isMapped());
+    EXPECT_EQ(t2.getNodeCount(), t1.getNodeCount());
+    EXPECT_EQ(Dump(t2.getRoot()), Dump(t1.getRoot()));
+    EXPECT_EQ(t2.getRoot()->getFirst("/posts/1.json/title")->getValue(), "First");
+    EXPECT_GT(t2.getGeneration(), t1.getGeneration());
+
+    // A mapped tree can be saved again
+    EXPECT_TRUE(t2.save(snapshot));
+
+    // Snapshot of another directory
+    Tree t3(currentPath + "/testtree/posts");
+    EXPECT_FALSE(t3.load(snapshot));
+
+    // Corrupted headers and nodes are refused, or load a tree that stays within the arena
+    std::string data;
+    {
+        std::ifstream is(snapshot, std::ifstream::binary);
+        data.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
+    SnapshotHeader header{};
+    memcpy(&header, data.data(), sizeof(header));
+    auto loadCorrupt = [&](const std::string& corrupt) {
+        std::ofstream(snapshot, std::ofstream::binary | std::ofstream::trunc) << corrupt;
+        Tree t(currentPath + "/testtree");
+        if (!t.load(snapshot))
+            return false;
+        Dump(t.getRoot());
+        t.getRoot()->get("/posts/.*");
+        return true;
+    };
+
+    std::string corrupt = data;
+    SnapshotHeader broken = header;
+    broken.arenaOffset = 8;
+    memcpy(&corrupt[0], &broken, sizeof(broken));
+    EXPECT_FALSE(loadCorrupt(corrupt));
+
+    size_t refused = 0;
+    for (size_t node : {(size_t)0, (size_t)1, t1.getNodeCount() - 1})
+        for (size_t b = 0; b < sizeof(Node); b++) {
+            corrupt = data;
+            corrupt[header.arenaOffset + sizeof(TreeLayout) + node * sizeof(Node) + b] ^= (char)0x80;
+            refused += !loadCorrupt(corrupt);
+        }
+    EXPECT_GT(refused, 3 * sizeof(Node) / 2);
+
+    std::ofstream(snapshot, std::ofstream::binary | std::ofstream::trunc) << data;
+    Tree restored(currentPath + "/testtree");
+    EXPECT_TRUE(restored.load(snapshot));
+
+    // Changed content
+    os.open(currentPath + "/testtree/posts/2.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "Second post";
+    os.close();
+    Tree t4(currentPath + "/testtree");
+    EXPECT_FALSE(t4.load(snapshot));
+    EXPECT_EQ(t4.getRoot(), nullptr);
+
+    // Broken file
+    os.open(snapshot, std::ofstream::out | std::ofstream::trunc);
+    os << "fblogsnp";
+    os.close();
+    EXPECT_FALSE(t4.load(snapshot));
+
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Metrics, Histogram) {
+
+    Histogram h;
+    EXPECT_EQ(h.getPercentile(99), 0);
+
+    for (uint64_t i = 1; i <= 1000; i++)
+        h.record(i * 1000);
+
+    EXPECT_EQ(h.getCount(), 1000);
+    EXPECT_EQ(h.getSum(), 500500000);
+
+    // Buckets are within 25% of their values
+    auto p50 = h.getPercentile(50);
+    EXPECT_GE(p50, 500000);
+    EXPECT_LE(p50, 500000 * 5 / 4);
+    auto p99 = h.getPercentile(99);
+    EXPECT_GE(p99, 990000);
+    EXPECT_LE(p99, 990000 * 5 / 4);
+    EXPECT_GE(h.getPercentile(100), 1000000);
+
+    std::string text;
+    h.format(text, "test_seconds", "a=\"b\"");
+    EXPECT_NE(text.find("test_seconds_bucket{a=\"b\",le=\"+Inf\"} 1000\n"), std::string::npos);
+    EXPECT_NE(text.find("test_seconds_sum{a=\"b\"} 0.500500000\n"), std::string::npos);
+    EXPECT_NE(text.find("test_seconds_count{a=\"b\"} 1000\n"), std::string::npos);
+    EXPECT_NE(text.find("test_seconds_bucket{a=\"b\",le=\"0.000001279\"} 1\n"), std::string::npos);
+
+}
+
+TEST(Metrics, Templates) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<ul><!-- print(items/.* item) --></ul>)";
+    os.close();
 
+    os.open(currentPath + "/testtree/item.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<li><!-- print(text) --></li>)";
+    os.close();
+
+    os.open(currentPath + "/testtree/items.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"([{"text": "a"}, {"text": "b"}, {"text": "c"}])";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    Metrics metrics;
+    Output out;
+    Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/", out, nullptr, &metrics);
+    EXPECT_EQ(out.getBuffer(), "<ul><li>a</li><li>b</li><li>c</li></ul>");
+    EXPECT_EQ(out.getSize(), out.getBuffer().size());
+
+    EXPECT_EQ(metrics.getTemplateTime("home").getCount(), 1);
+    EXPECT_EQ(metrics.getTemplateTime("item").getCount(), 3);
+
+    // Nested render time is part of the outer template time
+    EXPECT_GE(metrics.getTemplateTime("home").getSum(), metrics.getTemplateTime("item").getSum());
+
+    metrics.countResponse(200, 100);
+    metrics.countResponse(200, 50);
+    metrics.countResponse(404, 10);
+    EXPECT_EQ(metrics.getResponses(200), 2);
+    EXPECT_EQ(metrics.getBytes(), 160);
+
+    auto text = metrics.format();
+    EXPECT_NE(text.find("fblog_responses_total{status=\"200\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find("fblog_responses_total{status=\"404\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("fblog_response_bytes_total 160\n"), std::string::npos);
+    EXPECT_NE(text.find("fblog_template_duration_seconds_count{template=\"item\"} 3\n"), std::string::npos);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Utils, Gzip) {
+
+    std::string page;
+    for (int i = 0; i < 100; i++)
+        page += "<p>Paragraph " + std::to_string(i) + "</p>\n";
+
+    std::string compressed;
+    ASSERT_TRUE(Utils::Gzip(page, compressed));
+    EXPECT_LT(compressed.size(), page.size());
+    // gzip magic
+    EXPECT_EQ((unsigned char)compressed[0], 0x1f);
+    EXPECT_EQ((unsigned char)compressed[1], 0x8b);
+
+    z_stream zs{};
+    ASSERT_EQ(inflateInit2(&zs, 15 + 16), Z_OK);
+    std::string decompressed(page.size() + 1, '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+    zs.avail_in = (uInt)compressed.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&decompressed[0]);
+    zs.avail_out = (uInt)decompressed.size();
+    EXPECT_EQ(inflate(&zs, Z_FINISH), Z_STREAM_END);
+    decompressed.resize(zs.total_out);
+    inflateEnd(&zs);
+    EXPECT_EQ(decompressed, page);
+
+    EXPECT_TRUE(Utils::AcceptsGzip("gzip, deflate, br"));
+    EXPECT_TRUE(Utils::AcceptsGzip("br;q=1.0, GZIP;q=0.5"));
+    EXPECT_TRUE(Utils::AcceptsGzip("*"));
+    EXPECT_TRUE(Utils::AcceptsGzip("x-gzip"));
+    EXPECT_FALSE(Utils::AcceptsGzip(std::string_view()));
+    EXPECT_FALSE(Utils::AcceptsGzip(""));
+    EXPECT_FALSE(Utils::AcceptsGzip("deflate, br"));
+    EXPECT_FALSE(Utils::AcceptsGzip("gzip;q=0"));
+    EXPECT_FALSE(Utils::AcceptsGzip("gzip;q=0.0, *"));
+    EXPECT_FALSE(Utils::AcceptsGzip("gzipped"));
+
+}
+
+TEST(Utils, ETag) {
+
+    // XXH64 reference values
+    EXPECT_EQ(Utils::Hash64(""), 0xEF46DB3751D8E999ull);
+    EXPECT_EQ(Utils::Hash64("abc"), 0x44BC2CF5AD770999ull);
+    EXPECT_EQ(Utils::Hash64("Nobody inspects the spammish repetition"), 0xFBCEA83C8A378BF1ull);
+
+    std::vector<std::string_view> etags = {R"("0123456789abcdef")", R"("0123456789abcdef-gzip")"};
+    EXPECT_TRUE(Utils::MatchesETag(R"("0123456789abcdef")", etags));
+    EXPECT_TRUE(Utils::MatchesETag(R"(W/"0123456789abcdef-gzip")", etags));
+    EXPECT_TRUE(Utils::MatchesETag(R"("other", "0123456789abcdef" )", etags));
+    EXPECT_TRUE(Utils::MatchesETag("*", etags));
+    EXPECT_FALSE(Utils::MatchesETag(std::string_view(), etags));
+    EXPECT_FALSE(Utils::MatchesETag(R"("other")", etags));
+    EXPECT_FALSE(Utils::MatchesETag("0123456789abcdef", etags));
+    EXPECT_FALSE(Utils::MatchesETag(R"("0123456789abcdef")", {"", ""}));
+
+}
+
+TEST(Template, TagScanner) {
+
+    // The scanner must find exactly what the regular expression it replaces finds
+
+    static const std::regex tagRegex(R"(\<\!\-\-\s*(\w+)\((.*?)\)\s*\-\-\>)");
+
+    const std::vector<std::string> pieces = {"<!--", "-->", "<!-- ", " -->", "<", "!", "-", "--", "(", ")", " ", "  ",
+                                             "\n", "\r", "\t", "\v", "\f", std::string(1, '\0'), "\xe9", "print",
+                                             "if", "endif", "_", "a", "x1", "/", "$", ".*", "<p>", "</p>", "\""};
+    const std::vector<std::string> spaces = {"", " ", "  ", "\n", "\t ", "\r\n"};
+    const std::vector<std::string> names = {"print", "if", "endif", "template", "a_1", "", "x y", "-"};
+
+    std::mt19937 random(42);
+    size_t tags = 0;
+
+    for (int iteration = 0; iteration < 20000; iteration++) {
+
+        std::string source;
+        size_t count = random() % 40;
+        for (size_t i = 0; i < count; i++) {
+            if (random() % 3)
+                source += pieces[random() % pieces.size()];
+            else
+                // Mostly well formed tag, noise may break it
+                source += std::string("<!--") + spaces[random() % spaces.size()] + names[random() % names.size()] + "(" +
+                          pieces[random() % pieces.size()] + pieces[random() % pieces.size()] + ")" +
+                          spaces[random() % spaces.size()] + "-->";
+        }
+        // Long text runs go through the vectorized search
+        if (random() % 4 == 0)
+            source.insert(random() % (source.size() + 1), std::string(random() % 100, 'x'));
+
+        std::vector<std::string> expected;
+        std::cmatch m;
+        const char* searchStart = source.data();
+        const char* sourceEnd = source.data() + source.size();
+        while (std::regex_search(searchStart, sourceEnd, m, tagRegex)) {
+            expected.push_back(std::to_string(m[0].first - source.data()) + " " + std::to_string(m.length()) + " " +
+                               m[1].str() + " " + m[2].str());
+            searchStart = m.suffix().first;
+        }
+
+        std::vector<std::string> found;
+        Template::Tag tag;
+        size_t from = 0;
+        while (Template::FindTag(source, from, tag)) {
+            found.push_back(std::to_string(tag.position) + " " + std::to_string(tag.length) + " " +
+                            std::string(tag.function) + " " + std::string(tag.arguments));
+            from = tag.position + tag.length;
+        }
+
+        ASSERT_EQ(found, expected) << "Template: " << source;
+        tags += found.size();
+    }
+
+    EXPECT_GT(tags, 1000);
+
+}
+
+TEST(Prerender, Site) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/blog");
+    std::filesystem::create_directory(currentPath + "/testtree/blog/post1.post");
+    std::filesystem::create_directory(currentPath + "/testtree/search.query");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<h1><!-- print(@params/title) --></h1><!-- template(query page) -->)";
+    os.close();
+    os.open(currentPath + "/testtree/page.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<p><!-- print(title) --></p>)";
+    os.close();
+    os.open(currentPath + "/testtree/query.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<!-- print($QUERY_STRING) -->)";
+    os.close();
+    os.open(currentPath + "/testtree/404.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(Not found)";
+    os.close();
+    os.open(currentPath + "/testtree/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "Home"})";
+    os.close();
+    os.open(currentPath + "/testtree/blog/post1.post/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "Post 1"})";
+    os.close();
+    os.open(currentPath + "/testtree/search.query/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "Search"})";
+    os.close();
+    os.open(currentPath + "/testtree/about.page.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "About"})";
+    os.close();
+    os.open(currentPath + "/testtree/blog/post1.post/notes.txt", std::ofstream::out | std::ofstream::trunc);
+    os << R"(Notes)";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    EXPECT_EQ(t.getRoot()->getFirst("/blog/post1.post/params.json")->getUri(), "/blog/post1/params");
+
+    auto read = [](const std::string& file) {
+        std::ifstream is(file);
+        return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    };
+
+    Prerender::Settings settings;
+    settings.templatesPath = "/";
+    settings.threads = 4;
+    settings.gzip = true;
+
+    std::string out = currentPath + "/testout";
+    auto result = Prerender::Run(t, out, settings);
+
+    EXPECT_EQ(read(out + "/index.html"), "<h1>Home</h1>");
+    EXPECT_EQ(read(out + "/blog/post1/index.html"), "<h1>Post 1</h1>");
+    EXPECT_TRUE(std::filesystem::exists(out + "/blog/post1/index.html.gz"));
+    EXPECT_EQ(read(out + "/404.html"), "Not found");
+
+    // Json files with a template part are pages
+    EXPECT_EQ(read(out + "/about/index.html"), "<h1></h1><p>About</p>");
+
+    // Pages reading request variables
+    EXPECT_FALSE(std::filesystem::exists(out + "/search"));
+    EXPECT_EQ(result.skipped, std::vector<std::string>({"/search"}));
+
+    // Directories and their txt and template json files, not the templates nor the plain json values
+    EXPECT_TRUE(result.failed.empty());
+    EXPECT_EQ(result.pages, 5);
+    EXPECT_TRUE(std::filesystem::exists(out + "/blog/post1/notes/index.html"));
+    EXPECT_FALSE(std::filesystem::exists(out + "/blog/post1/params"));
+    EXPECT_FALSE(std::filesystem::exists(out + "/home"));
+
+    std::filesystem::remove_all(out);
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Generator, Allocations) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/blog.category");
+    std::filesystem::create_directory(currentPath + "/testtree/blog.category/first-post.post");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/home.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<title><!-- print(/params/sitename) --> - <!-- print(@params/title) --></title>
+<!-- template(category post) -->)";
+    os.close();
+    os.open(currentPath + "/testtree/category.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<h1><!-- print(params/name) --></h1>)";
+    os.close();
+    os.open(currentPath + "/testtree/post.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<article id="<!-- print($@PATH) -->"><a href="<!-- print($FULLPATH) -->"><!-- print(@params/title) --></a>
+<!-- print(@content) --><ul><!-- print(@params/tags/. tag) --></ul></article>)";
+    os.close();
+    os.open(currentPath + "/testtree/tag.html", std::ofstream::out | std::ofstream::trunc);
+    os << R"(<li><!-- print(name) --></li>)";
+    os.close();
+    os.open(currentPath + "/testtree/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"sitename": "A site with a long enough name"})";
+    os.close();
+    os.open(currentPath + "/testtree/blog.category/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"name": "Blog"})";
+    os.close();
+    os.open(currentPath + "/testtree/blog.category/first-post.post/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "The first post of the blog", "tags": [{"name": "one"}, {"name": "two"}]})";
+    os.close();
+    os.open(currentPath + "/testtree/blog.category/first-post.post/content.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "<p>Content</p>";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    Node* page = t.getRoot()->getFirst("/blog/first-post");
+    ASSERT_NE(page, nullptr);
+
+    // The first render compiles the templates and grows the buffers
+    Output out;
+    Generator::Generate(t, page, t.getRoot(), "home", nullptr, "/", out);
+    auto expected = out.getBuffer();
+    EXPECT_EQ(expected, R"(<title>A site with a long enough name - The first post of the blog</title>
+<h1>Blog</h1><article id="first-post"><a href="/blog/first-post">The first post of the blog</a>
+<p>Content</p><ul><li>one</li><li>two</li></ul></article>)");
+
+    out.clear();
+    uint64_t before = allocations.load();
+    Generator::Generate(t, page, t.getRoot(), "home", nullptr, "/", out);
+    EXPECT_EQ(allocations.load() - before, 0);
+    EXPECT_EQ(out.getBuffer(), expected);
+
+    before = allocations.load();
+    EXPECT_EQ(t.getRoot()->getFirst("/blog.category/first-post/params.json/tags/1/name")->getValue(), "two");
+    EXPECT_EQ(allocations.load() - before, 0);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Utils, SplitView) {
+
+    auto split = [](const std::string& s) {
+        std::vector<std::string> result;
+        for (auto part : Utils::SplitView(s, '/'))
+            result.emplace_back(part);
+        return result;
+    };
+
+    // Same parts as getline() gives
+    for (std::string s : {"", "/", "a", "/a", "a/", "a//b", "//", "/a/b/", "a/b//"}) {
+        std::vector<std::string> expected;
+        std::stringstream ss(s);
+        std::string item;
+        while (getline(ss, item, '/'))
+            expected.push_back(item);
+        EXPECT_EQ(split(s), expected) << s;
+        EXPECT_EQ(Utils::Split(s, '/'), expected) << s;
+    }
+
+}
+
+TEST(Tree, Routes) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+    std::filesystem::create_directory(currentPath + "/testtree/blog.category");
+    std::filesystem::create_directory(currentPath + "/testtree/blog.category/post1.post");
+    std::filesystem::create_directory(currentPath + "/testtree/blog.old");
+
+    std::ofstream os;
+    os.open(currentPath + "/testtree/blog.category/post1.post/params.json", std::ofstream::out | std::ofstream::trunc);
+    os << R"({"title": "First", "": "empty", "a b": "space", "a/b": "slash", "tags": ["x", "y"]})";
+    os.close();
+    os.open(currentPath + "/testtree/blog.old/c++.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "Regex key";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+    Node* root = t.getRoot();
+
+    // Query strings, fragments and trailing slashes do not change the node
+    auto post = t.resolve(Utils::NormalizeUri("/blog/post1/?utm_source=feed#top"));
+    ASSERT_NE(post, nullptr);
+    EXPECT_EQ(post->getPath(), "/blog.category/post1.post");
+    EXPECT_EQ(t.resolve("/"), root);
+    EXPECT_EQ(t.resolve("/blog/post2"), nullptr);
+
+    // The first of the nodes sharing a URI wins, like with getFirst()
+    EXPECT_EQ(t.resolve("/blog")->getKey(), "blog.category");
+
+    // Every URI resolves to the same node as the path walk
+    std::vector<std::string> uris = {"", "blog", "/blog/", "//blog", "/blog.old", "/blog/post\\d+", "/blog/post1/params/.",
+                                     "/blog.category/post1.post/params.json/title", "/blog/../blog"};
+    std::function<void(Node*)> walk = [&](Node* n) {
+        uris.push_back(n->getUri());
+        for (size_t i = 0; i < n->getChildCount(); i++)
+            walk(n->getChild(i));
+    };
+    walk(root);
+    for (const auto &uri : uris)
+        EXPECT_EQ(t.resolve(uri), root->getFirst(uri)) << uri;
+
+    // Keys with a '/' are not routes, the walk reads it as two segments
+    EXPECT_EQ(t.resolve("/blog/post1/params/a/b"), nullptr);
+
+    EXPECT_GT(t.getRouteCount(), 5);
+    EXPECT_LT(t.getRouteCount(), t.getNodeCount());
+
+    // Mapped snapshots have the routes too
+    std::string snapshot = currentPath + "/testsnapshot";
+    EXPECT_TRUE(t.save(snapshot));
+    Tree mapped(currentPath + "/testtree");
+    EXPECT_TRUE(mapped.load(snapshot));
+    EXPECT_EQ(mapped.getRouteCount(), t.getRouteCount());
+    EXPECT_EQ(mapped.resolve("/blog/post1/params/title")->getValue(), "First");
+
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Generator, Fragments) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    auto write = [&](const std::string& name, const std::string& content) {
+        os.open(currentPath + "/testtree/" + name, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+        os.close();
+    };
+
+    write("home.html", R"([<!-- print(@title) -->|<!-- print(/nav menu) -->|<!-- print(/nav pagemenu) -->|<!-- print(/nav query) -->|<!-- print(/nav wrap) -->])");
+    write("menu.html", R"(<!-- print(items/.) -->)");
+    write("pagemenu.html", R"(<!-- print($@PATH) -->)");
+    write("query.html", R"(<!-- print($QUERY_STRING) -->)");
+    write("wrap.html", R"((<!-- print(items pagemenu) -->))");
+    write("nav.json", R"({"items": ["x", "y"]})");
+    write("a.json", R"({"title": "A"})");
+    write("b.json", R"({"title": "B"})");
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    Metrics metrics;
+    auto render = [&](const std::string& page) {
+        Output out;
+        Generator::RenderInfo info;
+        Generator::Generate(t, t.getRoot()->getFirst(page), t.getRoot(), "home", nullptr, "/", out, &info, &metrics);
+        EXPECT_TRUE(info.requestDependent);
+        return out.getBuffer();
+    };
+
+    using Result = FragmentCache::Result;
+    FragmentCache& fragments = t.getFragments();
+
+    // Only the menu reads nothing but its template and data, the wrapper depends on the page through pagemenu.
+    // The page template itself is not cached.
+    EXPECT_EQ(render("a"), "[A|xy|a||(a)]");
+    EXPECT_EQ(fragments.getCount(Result::Hit), 0);
+    EXPECT_EQ(fragments.getCount(Result::Miss), 1);
+    EXPECT_EQ(fragments.getCount(Result::Uncacheable), 4);
+
+    EXPECT_EQ(render("b"), "[B|xy|b||(b)]");
+    EXPECT_EQ(fragments.getCount(Result::Hit), 1);
+    EXPECT_EQ(fragments.getCount(Result::Miss), 1);
+    EXPECT_EQ(fragments.getCount(Result::Uncacheable), 8);
+    EXPECT_EQ(fragments.getBytes(), 2);
+
+    EXPECT_EQ(render("a"), "[A|xy|a||(a)]");
+    EXPECT_EQ(metrics.getTemplate("menu").fragmentHits, 2);
+    EXPECT_EQ(metrics.getTemplate("menu").fragmentMisses, 1);
+    EXPECT_EQ(metrics.getTemplate("pagemenu").fragmentUncacheable, 6);
+    EXPECT_NE(metrics.format().find("fblog_fragment_cache_total{template=\"wrap\",result=\"uncacheable\"} 3\n"),
+              std::string::npos);
+
+    // A new build drops the fragments
+    write("nav.json", R"({"items": ["z"]})");
+    t.build();
+    EXPECT_EQ(fragments.size(), 0);
+    EXPECT_EQ(render("a"), "[A|z|a||(a)]");
+
+    // Fragments over the size limit are rendered every time
+    t.build();
+    fragments.setMaxBytes(0);
+    EXPECT_EQ(render("b"), "[B|z|b||(b)]");
+    EXPECT_EQ(render("b"), "[B|z|b||(b)]");
+    EXPECT_EQ(fragments.size(), 0);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+// FastCGI serves from epoll loops, Linux only
+#ifdef __linux__
+TEST(FastCgi, UnixSocket) {
+
+    std::string socketPath = std::filesystem::current_path().string() + "/testsocket";
+    int listenFd = FcgiServer::Listen(socketPath, 16);
+    ASSERT_GE(listenFd, 0);
+
+    std::atomic<int> bigPages(0);
+    FcgiServer server(listenFd, 2, [&](FcgiRequest& request) {
+        if (request.getParam("REQUEST_URI") == "/broken") {
+            request.write("Status: 200 OK\r\n\r\npart");
+            request.fail(2);
+            return;
+        }
+        if (request.getParam("REQUEST_URI") == "/big") {
+            bigPages++;
+            request.write("Status: 200 OK\r\n\r\n");
+            std::string chunk(100000, 'x');
+            for (int i = 0; i < 10; i++)
+                request.write(chunk);
+            return;
+        }
+        request.write("Status: 200 OK\r\n\r\n", std::string(request.getParam("REQUEST_URI")) + "|" +
+                                                 std::to_string(request.getParam("LONG").size()) + "|" +
+                                                 request.getStdin() + "|" + std::to_string(request.getParams().size()));
+    });
+    std::thread serverThread([&]() {
+        server.run();
+    });
+
+    // Minimal web server side of the protocol
+
+    auto connectClient = [&]() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socketPath.c_str());
+        EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+        return fd;
+    };
+
+    auto record = [](uint8_t type, uint16_t id, const std::string& content) {
+        char header[Fcgi::headerSize];
+        Fcgi::WriteHeader(header, type, id, content.size());
+        header[6] = (char)((8 - content.size() % 8) % 8);
+        return std::string(header, sizeof(header)) + content + std::string((size_t)header[6], '\0');
+    };
+
+    auto request = [&](uint16_t id, bool keep, const std::string& uri, const std::string& body) {
+        std::string begin(8, '\0');
+        begin[1] = (char)Fcgi::responder;
+        begin[2] = keep ? (char)Fcgi::keepConnection : 0;
+        std::string params;
+        Fcgi::AppendPair(params, "REQUEST_URI", uri);
+        Fcgi::AppendPair(params, "LONG", std::string(300, 'l'));
+        // A pair split between two records
+        return record(Fcgi::BeginRequest, id, begin) + record(Fcgi::Params, id, params.substr(0, 5)) +
+               record(Fcgi::Params, id, params.substr(5)) + record(Fcgi::Params, id, "") +
+               (body.empty() ? "" : record(Fcgi::Stdin, id, body)) + record(Fcgi::Stdin, id, "");
+    };
+
+    auto send = [](int fd, const std::string& data) {
+        EXPECT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+    };
+
+    auto readExactly = [](int fd, char* buffer, size_t size) {
+        for (size_t done = 0; done < size; ) {
+            ssize_t n = read(fd, buffer + done, size - done);
+            if (n <= 0)
+                return false;
+            done += (size_t)n;
+        }
+        return true;
+    };
+
+    // Reads records until one of the type arrives for the request, returns the collected STDOUT
+    // or the content of that record for other types
+    auto receive = [&](int fd, uint16_t id, uint8_t until, std::string* endContent = nullptr) {
+        std::string out;
+        while (true) {
+            unsigned char header[Fcgi::headerSize];
+            if (!readExactly(fd, reinterpret_cast<char*>(header), sizeof(header)))
+                return std::string("<closed>");
+            auto recordId = (uint16_t)(header[2] << 8 | header[3]);
+            std::string content((size_t)header[4] << 8 | header[5], '\0');
+            std::string padding(header[6], '\0');
+            if (!readExactly(fd, &content[0], content.size()) || !readExactly(fd, &padding[0], padding.size()))
+                return std::string("<closed>");
+            if (recordId != id)
+                continue;
+            if (header[1] == Fcgi::Stdout)
+                out += content;
+            if (header[1] == until) {
+                if (endContent)
+                    *endContent = content;
+                return until == Fcgi::EndRequest ? out : content;
+            }
+        }
+    };
+
+    // Keep-alive connection serving requests one after another, and two of them sent at once
+    int fd = connectClient();
+    send(fd, request(1, true, "/a", "body"));
+    EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n/a|300|body|2");
+    send(fd, request(1, true, "/b", ""));
+    EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n/b|300||2");
+    send(fd, request(2, true, "/c", "") + request(3, true, "/d", ""));
+    EXPECT_EQ(receive(fd, 2, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n/c|300||2");
+    EXPECT_EQ(receive(fd, 3, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n/d|300||2");
+
+    // Output larger than the socket buffer is queued and sent in records of at most 64K
+    send(fd, request(1, true, "/big", ""));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n" + std::string(1000000, 'x'));
+
+    // Requests from a web server not reading its responses wait in the socket once the queued output is over the limit
+    bigPages = 0;
+    for (int i = 0; i < 8; i++) {
+        send(fd, request(1, true, "/big", ""));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_LE(bigPages, 3);
+    for (int i = 0; i < 8; i++)
+        EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n" + std::string(1000000, 'x'));
+    EXPECT_EQ(bigPages, 8);
+
+    // Management records
+    std::string names;
+    Fcgi::AppendPair(names, "FCGI_MPXS_CONNS", "");
+    send(fd, record(Fcgi::GetValues, 0, names));
+    std::string values;
+    Fcgi::AppendPair(values, "FCGI_MPXS_CONNS", "1");
+    EXPECT_EQ(receive(fd, 0, Fcgi::GetValuesResult), values);
+
+    // Other roles are refused
+    std::string authorizer(8, '\0');
+    authorizer[1] = 2;
+    authorizer[2] = (char)Fcgi::keepConnection;
+    send(fd, record(Fcgi::BeginRequest, 4, authorizer));
+    std::string end;
+    receive(fd, 4, Fcgi::EndRequest, &end);
+    ASSERT_EQ(end.size(), 8);
+    EXPECT_EQ(end[4], (char)Fcgi::UnknownRole);
+    close(fd);
+
+    // A failed response ends with its status and closes the connection, even with FCGI_KEEP_CONN
+    char c;
+    fd = connectClient();
+    send(fd, request(1, true, "/broken", ""));
+    EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest, &end), "Status: 200 OK\r\n\r\npart");
+    ASSERT_EQ(end.size(), 8);
+    EXPECT_EQ(end.substr(0, 5), std::string("\0\0\0\2\0", 5));
+    EXPECT_EQ(read(fd, &c, 1), 0);
+    close(fd);
+
+    // Without FCGI_KEEP_CONN the connection is closed after the response
+    fd = connectClient();
+    send(fd, request(1, false, "/e", ""));
+    EXPECT_EQ(receive(fd, 1, Fcgi::EndRequest), "Status: 200 OK\r\n\r\n/e|300||2");
+    EXPECT_EQ(read(fd, &c, 1), 0);
+    close(fd);
+
+    server.stop();
+    serverThread.join();
+    close(listenFd);
+    std::filesystem::remove(socketPath);
+
+}
+#endif
+
+TEST(Tree, LazyContent) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    auto write = [&](const std::string& name, const std::string& content) {
+        os.open(currentPath + "/testtree/" + name, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+        os.close();
+    };
+
+    write("home.html", R"(<!-- print(@params/title) -->:<!-- print(@content) -->)");
+    write("params.json", R"({"title": "T"})");
+    for (char c : std::string("abcd")) {
+        std::filesystem::create_directory(currentPath + "/testtree/" + c);
+        write(std::string(1, c) + "/params.json", std::string(R"({"title": ")") + c + R"("})");
+        write(std::string(1, c) + "/content.txt", std::string(1000, c));
+    }
+
+    Tree eager(currentPath + "/testtree");
+    eager.build();
+
+    Tree t(currentPath + "/testtree");
+    t.setLazyContent(2500);
+    t.build();
+
+    // Same structure, file contents are not in the arena
+    EXPECT_EQ(t.getNodeCount(), eager.getNodeCount());
+    EXPECT_LT(t.getArenaSize() + 4000, eager.getArenaSize());
+    EXPECT_EQ(t.getContent().getLoads(), 0);
+
+    ContentStore& content = t.getContent();
+    ContentStore::Scope scope;
+    EXPECT_EQ(t.getRoot()->getFirst("/a/content")->getValue(), std::string(1000, 'a'));
+    EXPECT_EQ(t.getRoot()->getFirst("/a/content")->getValue(), std::string(1000, 'a'));
+    EXPECT_EQ(content.getLoads(), 1);
+
+    // Json values are read at build
+    EXPECT_EQ(t.getRoot()->getFirst("/b/params/title")->getValue(), "b");
+    EXPECT_EQ(content.getLoads(), 1);
+
+    // The least recently used value goes when the budget is exceeded
+    t.getRoot()->getFirst("/b/content")->getValue();
+    t.getRoot()->getFirst("/a/content")->getValue();
+    t.getRoot()->getFirst("/c/content")->getValue();
+    EXPECT_EQ(content.getLoads(), 3);
+    EXPECT_EQ(content.getEvictions(), 1);
+    EXPECT_EQ(content.getBytes(), 2000);
+    t.getRoot()->getFirst("/a/content")->getValue();
+    EXPECT_EQ(content.getLoads(), 3);
+    t.getRoot()->getFirst("/b/content")->getValue();
+    EXPECT_EQ(content.getLoads(), 4);
+
+    // Templates and values stay usable while they are evicted during a render
+    for (char c : std::string("abcdabcd"))
+        EXPECT_EQ(Generator::Generate(t, t.getRoot()->getFirst(std::string("/") + c), t.getRoot(), "home", nullptr, "/"),
+                  std::string(1, c) + ":" + std::string(1000, c));
+
+    // A compiled template is not read again, even once its source is evicted
+    Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/");
+    for (char c : std::string("bcd"))
+        t.getRoot()->getFirst(std::string("/") + c + "/content")->getValue();
+    uint64_t loads = content.getLoads();
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/"), "T:");
+    EXPECT_EQ(content.getLoads(), loads);
+
+    // Concurrent readers
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong{0};
+    for (int i = 0; i < 4; i++)
+        threads.emplace_back([&, i]() {
+            std::mt19937 random(i);
+            for (int j = 0; j < 500; j++) {
+                char c = "abcd"[random() % 4];
+                ContentStore::Scope scope;
+                if (t.getRoot()->getFirst(std::string("/") + c + "/content")->getValue() != std::string(1000, c))
+                    wrong++;
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(wrong, 0);
+    EXPECT_LE(content.getBytes(), 3000);
+
+    // Snapshots keep the mode they were written in
+    std::string snapshot = currentPath + "/testsnapshot";
+    EXPECT_TRUE(t.save(snapshot));
+    Tree mapped(currentPath + "/testtree");
+    EXPECT_FALSE(mapped.load(snapshot));
+    mapped.setLazyContent(2500);
+    EXPECT_TRUE(mapped.load(snapshot));
+    EXPECT_EQ(mapped.getRoot()->getFirst("/d/content")->getValue(), std::string(1000, 'd'));
+    EXPECT_EQ(mapped.getContent().getLoads(), 1);
+
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Tree, Stats) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directories(currentPath + "/testtree/posts");
+    std::ofstream os;
+    for (int i = 0; i < 10; i++) {
+        os.open(currentPath + "/testtree/posts/" + std::to_string(i) + ".json", std::ofstream::out | std::ofstream::trunc);
+        os << R"({"title": "t", "tags": ["a", "b"]})";
+        os.close();
+    }
+    os.open(currentPath + "/testtree/about.txt", std::ofstream::out | std::ofstream::trunc);
+    os << "hello";
+    os.close();
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    TreeStats stats;
+    t.getStats(stats, 3);
+
+    // Root, about.txt, posts and 10 posts of a title, tags and 2 tags
+    EXPECT_EQ(stats.nodes, 53);
+    EXPECT_EQ(stats.directories, 2);
+    EXPECT_EQ(stats.indexedNodes, 1);
+    EXPECT_EQ(stats.depths, std::vector<uint64_t>({1, 2, 10, 20, 20}));
+    EXPECT_EQ(stats.fanOuts, std::vector<uint64_t>({31, 0, 21, 0, 1}));
+
+    EXPECT_EQ(stats.nodeBytes, 53 * sizeof(Node));
+    EXPECT_EQ(stats.valueBytes, 10 + 20 + 5);
+    EXPECT_LT(stats.keyBytes, stats.keyReferencedBytes);
+    EXPECT_EQ(stats.arenaBytes, sizeof(TreeLayout) + stats.nodeBytes + stats.indexBytes + stats.keyBytes + stats.valueBytes);
+    EXPECT_GE(stats.arenaAllocated, stats.arenaBytes);
+    EXPECT_GT(stats.routeBytes, 0);
+    EXPECT_GT(stats.searchBytes, 0);
+
+    ASSERT_EQ(stats.largest.size(), 3);
+    EXPECT_EQ(stats.largest[0].path, "/posts");
+    EXPECT_EQ(stats.largest[0].nodes, 51);
+    ASSERT_EQ(stats.widest.size(), 3);
+    EXPECT_EQ(stats.widest[0].path, "/posts");
+    EXPECT_EQ(stats.widest[0].children, 10);
+    EXPECT_TRUE(stats.widest[0].indexed);
+    EXPECT_FALSE(stats.widest[1].indexed);
+
+    // Every directory is timed with the files in it
+    EXPECT_TRUE(stats.built);
+    ASSERT_EQ(stats.slowest.size(), 2);
+    for (const auto &d : stats.slowest)
+        EXPECT_EQ(d.files, d.path == "/posts" ? 10 : 1);
+    EXPECT_NE(stats.format().find("/posts"), std::string::npos);
+
+    // Snapshots have the same shape and no build times
+    ASSERT_TRUE(t.save(currentPath + "/testtree.snapshot"));
+    Tree mapped(currentPath + "/testtree");
+    ASSERT_TRUE(mapped.load(currentPath + "/testtree.snapshot"));
+    TreeStats mappedStats;
+    mapped.getStats(mappedStats, 3);
+    EXPECT_EQ(mappedStats.depths, stats.depths);
+    EXPECT_EQ(mappedStats.arenaBytes, stats.arenaBytes);
+    EXPECT_GE(mappedStats.arenaAllocated, mappedStats.arenaBytes);
+    EXPECT_FALSE(mappedStats.built);
+    EXPECT_TRUE(mappedStats.slowest.empty());
+
+    std::filesystem::remove(currentPath + "/testtree.snapshot");
     std::filesystem::remove_all(currentPath + "/testtree");
 
-}
\ No newline at end of file
+}
+
+TEST(Generator, Budget) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directory(currentPath + "/testtree");
+
+    std::ofstream os;
+    auto write = [&](const std::string& name, const std::string& content) {
+        os.open(currentPath + "/testtree/" + name, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+        os.close();
+    };
+
+    std::string items;
+    for (int i = 0; i < 100; i++)
+        items += std::string(i ? "," : "") + "\"0123456789\"";
+
+    write("loop.html", R"((<!-- print(/data loop) -->))");
+    write("list.html", R"(<!-- print(/items/.+) -->.)");
+    write("data.json", R"({"v": 1})");
+    write("items.json", "[" + items + "]");
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    auto render = [&](const std::string& templateName, const RenderBudget& budget, bool& aborted) {
+        Output out;
+        Generator::RenderInfo info;
+        Generator::Generate(t, t.getRoot(), t.getRoot(), templateName, nullptr, "/", out, &info, nullptr, budget);
+        aborted = info.aborted;
+        return out.getBuffer();
+    };
+
+    bool aborted = false;
+    RenderBudget budget;
+
+    EXPECT_EQ(render("list", budget, aborted).size(), 1001);
+    EXPECT_FALSE(aborted);
+
+    // A template printing itself stops at the depth limit, and the cut renders are not cached
+    EXPECT_EQ(render("loop", budget, aborted), std::string(64, '('));
+    EXPECT_TRUE(aborted);
+    EXPECT_EQ(t.getFragments().size(), 0);
+
+    budget.depth = 3;
+    EXPECT_EQ(render("loop", budget, aborted), "(((");
+    EXPECT_TRUE(aborted);
+
+    // Output stops after the first value over the limit
+    budget = RenderBudget();
+    budget.bytes = 50;
+    EXPECT_EQ(render("list", budget, aborted), "012345678901234567890123456789012345678901234567890123456789");
+    EXPECT_TRUE(aborted);
+
+    budget = RenderBudget();
+    budget.time = std::chrono::nanoseconds(1);
+    EXPECT_LT(render("list", budget, aborted).size(), 1001);
+    EXPECT_TRUE(aborted);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+// FastCGI serves from epoll loops, Linux only
+#ifdef __linux__
+TEST(FastCgi, Overload) {
+
+    std::string socketPath = std::filesystem::current_path().string() + "/testsocket";
+    int listenFd = FcgiServer::Listen(socketPath, 256);
+    ASSERT_GE(listenFd, 0);
+
+    auto record = [](uint8_t type, uint16_t id, const std::string& content) {
+        char header[Fcgi::headerSize];
+        Fcgi::WriteHeader(header, type, id, content.size());
+        return std::string(header, sizeof(header)) + content;
+    };
+
+    // One request per connection, the connection is closed after it
+    auto send = [&]() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socketPath.c_str());
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        std::string begin(8, '\0');
+        begin[1] = (char)Fcgi::responder;
+        std::string data = record(Fcgi::BeginRequest, 1, begin) + record(Fcgi::Params, 1, "") + record(Fcgi::Stdin, 1, "");
+        if (write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    };
+
+    // STDOUT until END_REQUEST
+    auto receive = [&](int fd) {
+        std::string out;
+        while (true) {
+            unsigned char header[Fcgi::headerSize];
+            if (recv(fd, header, sizeof(header), MSG_WAITALL) != (ssize_t)sizeof(header))
+                return std::string("<closed>");
+            std::string content(((size_t)header[4] << 8 | header[5]) + header[6], '\0');
+            if (!content.empty() && recv(fd, &content[0], content.size(), MSG_WAITALL) != (ssize_t)content.size())
+                return std::string("<closed>");
+            if (header[1] == Fcgi::Stdout)
+                out += content.substr(0, (size_t)header[4] << 8 | header[5]);
+            if (header[1] == Fcgi::EndRequest)
+                return out;
+        }
+    };
+
+    // Far more connections than the queue holds, served one by one they would wait 2 s.
+    // Bounded by length or by time, most are turned away at once.
+    auto overload = [&](size_t limit, std::chrono::nanoseconds timeout) {
+
+        FcgiServer server(listenFd, 1, [](FcgiRequest& request) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            request.write("Status: 200 OK\r\n\r\n");
+        });
+        server.setQueueLimit(limit, timeout, [](FcgiRequest& request) {
+            request.write("Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+        });
+        std::thread serverThread([&]() {
+            server.run();
+        });
+
+        const int count = 100;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<int> fds;
+        for (int i = 0; i < count; i++) {
+            fds.push_back(send());
+            ASSERT_GE(fds.back(), 0);
+        }
+
+        int served = 0, shed = 0;
+        for (int fd : fds) {
+            std::string response = receive(fd);
+            if (response == "Status: 200 OK\r\n\r\n")
+                served++;
+            else if (response == "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n")
+                shed++;
+            close(fd);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // Every one is answered
+        EXPECT_EQ(served + shed, count);
+        EXPECT_GT(served, 0);
+        EXPECT_GT(shed, count / 2);
+        EXPECT_EQ(server.getRejected(), (uint64_t)shed);
+        EXPECT_LT(elapsed, std::chrono::milliseconds(1500));
+
+        // The queue is empty again
+        int fd = send();
+        ASSERT_GE(fd, 0);
+        EXPECT_EQ(receive(fd), "Status: 200 OK\r\n\r\n");
+        close(fd);
+
+        server.stop();
+        serverThread.join();
+    };
+
+    overload(8, std::chrono::nanoseconds::max());
+    overload(0, std::chrono::milliseconds(100));
+
+    // Requests arriving while the queue is worked through are read between two renders and turned away at once,
+    // not once the queue is empty again
+    {
+        FcgiServer server(listenFd, 1, [](FcgiRequest& request) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            request.write("Status: 200 OK\r\n\r\n");
+        });
+        server.setQueueLimit(8, std::chrono::nanoseconds::max(), [](FcgiRequest& request) {
+            request.write("Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+        });
+        std::thread serverThread([&]() {
+            server.run();
+        });
+
+        std::vector<int> early, late;
+        for (int i = 0; i < 16; i++)
+            early.push_back(send());
+        std::this_thread::sleep_for(std::chrono::milliseconds(75));
+        for (int i = 0; i < 8; i++)
+            late.push_back(send());
+
+        int lateShed = 0;
+        for (int fd : late) {
+            lateShed += receive(fd) == "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n";
+            close(fd);
+        }
+        for (int fd : early) {
+            receive(fd);
+            close(fd);
+        }
+        EXPECT_GE(lateShed, 4);
+
+        server.stop();
+        serverThread.join();
+    }
+
+    close(listenFd);
+    std::filesystem::remove(socketPath);
+
+}
+#endif
+
+TEST(Generator, SortedPrint) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::filesystem::create_directories(currentPath + "/testtree/posts");
+    std::filesystem::create_directories(currentPath + "/testtree/cats/x");
+    std::filesystem::create_directories(currentPath + "/testtree/cats/y");
+
+    std::ofstream os;
+    auto write = [&](const std::string& name, const std::string& content) {
+        os.open(currentPath + "/testtree/" + name, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+        os.close();
+    };
+
+    write("posts/a.json", R"({"date": "2024-03-01", "order": "10"})");
+    write("posts/b.json", R"({"date": "2024-01-15", "order": "9"})");
+    write("posts/c.json", R"({"date": "2024-02-10", "order": "100"})");
+    write("posts/d.json", R"({"order": "1"})");
+    write("posts/e.json", R"({"date": "2023-12-31", "order": "2"})");
+    write("cats/x/p.json", R"({"date": "3"})");
+    write("cats/y/q.json", R"({"date": "1"})");
+    write("cats/y/r.json", R"({"date": "2"})");
+    write("item.html", R"(<!-- print($PATH) -->)");
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    auto render = [&](const std::string& arguments) {
+        write("list.html", "<!-- print(" + arguments + ") -->");
+        t.build();
+        return Generator::Generate(t, t.getRoot(), t.getRoot(), "list", nullptr, "/");
+    };
+
+    // Children without the value come last in both directions
+    EXPECT_EQ(render("/posts/.* item sort=date"), "ebcad");
+    EXPECT_EQ(render("/posts/.* item sort=-date"), "acbed");
+
+    // Numbers are compared as numbers
+    EXPECT_EQ(render("/posts/.* item sort=order"), "debac");
+    EXPECT_EQ(render("/posts/.* item sort=-order limit=2"), "ca");
+    EXPECT_EQ(render("/posts/.* item sort=-order limit=2 page=2"), "be");
+    EXPECT_EQ(render("/posts/.* item sort=-order limit=2 page=3"), "d");
+    EXPECT_EQ(render("/posts/.* item sort=-order offset=4"), "d");
+    EXPECT_EQ(render("/posts/.* item limit=2 offset=1"), "bc");
+    EXPECT_EQ(render("posts/[ab]\\.json item sort=-date"), "ab");
+    EXPECT_EQ(render("/posts/.* item limit=0"), "");
+
+    // Nodes of many parents are sorted together
+    EXPECT_EQ(render("/cats/.*/.* item sort=date"), "qrp");
+    EXPECT_EQ(render("/cats/.*/.* item sort=-date limit=1"), "p");
+
+    // A limit from a request variable, missing without a request
+    Generator::RenderInfo info;
+    write("list.html", "<!-- print(/posts/.* item sort=date limit=$LIMIT) -->");
+    t.build();
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "list", nullptr, "/", &info), "ebcad");
+    EXPECT_TRUE(info.requestDependent);
+
+    // Indexes are built once per tree build and direction
+    write("list.html", R"(<!-- print(/posts/.* item sort=date limit=1) -->|<!-- print(/posts/.* item sort=date offset=4) -->|<!-- print(/posts/.* item sort=-date limit=1) -->)");
+    t.build();
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "list", nullptr, "/"), "e|d|a");
+    EXPECT_EQ(t.getSorted().size(), 2);
+
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}
+
+TEST(Search, Index) {
+
+    SearchIndex index;
+    index.addDocument(10);
+    index.addText("Hello World, hello!");
+    index.addDocument(20);
+    index.addText("hello there");
+    index.addText("and there");
+    index.addDocument(30);
+    index.addText("Привет world 2024");
+    index.finish();
+
+    EXPECT_EQ(index.getDocumentCount(), 3);
+    EXPECT_EQ(index.getTermCount(), 6);
+
+    std::vector<SearchIndex::Result> results;
+    auto ids = [&](std::string_view query, size_t limit = 10) {
+        index.search(query, limit, results);
+        std::string s;
+        for (const auto &r : results)
+            s += std::to_string(r.id) + " ";
+        return s;
+    };
+
+    // Every word must match, more occurrences in a shorter text rank higher
+    EXPECT_EQ(ids("hello"), "10 20 ");
+    EXPECT_EQ(ids("HELLO, world"), "10 ");
+    EXPECT_EQ(ids("there"), "20 ");
+    EXPECT_EQ(ids("world"), "10 30 ");
+    EXPECT_EQ(ids("Привет 2024"), "30 ");
+
+    // A saved index searches the same when loaded, a broken one loads empty
+    std::string data;
+    index.save(data);
+    SearchIndex loaded;
+    ASSERT_TRUE(loaded.load(data));
+    EXPECT_EQ(loaded.getTermCount(), index.getTermCount());
+    EXPECT_EQ(loaded.getPostingCount(), index.getPostingCount());
+    loaded.search("hello", 10, results);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_EQ(results[0].id, 10);
+    EXPECT_FALSE(loaded.load(std::string_view(data).substr(0, data.size() - 1)));
+    EXPECT_EQ(loaded.getDocumentCount(), 0);
+    data[data.size() - 3 * 2 * sizeof(uint32_t) - 8] = 100;
+    EXPECT_FALSE(loaded.load(data));
+    EXPECT_EQ(ids("hello missing"), "");
+    EXPECT_EQ(ids(" ,. "), "");
+    EXPECT_EQ(ids("hello", 1), "10 ");
+    EXPECT_EQ(ids("hello", 0), "");
+
+    EXPECT_EQ(Utils::GetQueryParam("page=2&q=fast+cgi%21&x", "q"), "fast+cgi%21");
+    EXPECT_EQ(Utils::GetQueryParam("page=2&q=fast", "x"), "");
+    std::string decoded;
+    Utils::UrlDecode("fast+cgi%21%2", decoded);
+    EXPECT_EQ(decoded, "fast cgi!%2");
+
+}
+
+TEST(Generator, Search) {
+
+    std::string currentPath = std::filesystem::current_path().string();
+
+    std::ofstream os;
+    auto write = [&](const std::string& name, const std::string& content) {
+        std::filesystem::create_directories(std::filesystem::path(currentPath + "/testtree/" + name).parent_path());
+        os.open(currentPath + "/testtree/" + name, std::ofstream::out | std::ofstream::trunc);
+        os << content;
+        os.close();
+    };
+
+    write("a/params.json", R"({"title": "FastCGI servers", "tags": ["c++", "epoll"]})");
+    write("a/content.txt", "Serving pages over FastCGI from epoll loops.");
+    write("b/params.json", R"({"title": "Templates"})");
+    write("b/content.txt", "Templates are compiled once and rendered by the FastCGI server.");
+    write("b/c/params.json", R"({"title": "Nested"})");
+    write("b/c/content.txt", "A nested page about epoll.");
+    // A flat directory of posts
+    write("posts/1.json", R"({"title": "Polling sockets", "year": 2024, "draft": false})");
+    write("posts/2.json", R"({"title": "Sockets and pipes", "tags": ["unix"]})");
+    write("posts/3.json", R"({"title": "Nothing else", "year": "2024"})");
+    write("result.html", R"(<!-- print($PATH) -->:<!-- print(params/title) -->;)");
+    write("home.html", R"([<!-- search(fastcgi result) -->|<!-- search("epoll loops" result) -->|<!-- search(epoll result 1) -->|<!-- search($QUERY_STRING result) -->])");
+
+    Tree t(currentPath + "/testtree");
+    t.build();
+
+    // The root, a, b, b/c and every post, html files are not indexed
+    EXPECT_EQ(t.getSearchIndex().getDocumentCount(), 7);
+    std::vector<Node*> results;
+    t.search("result", 10, results);
+    EXPECT_TRUE(results.empty());
+
+    auto uris = [&](std::string_view query) {
+        t.search(query, 10, results);
+        std::string s;
+        for (Node* n : results)
+            s += n->getUri() + " ";
+        return s;
+    };
+    EXPECT_EQ(uris("sockets"), "/posts/1 /posts/2 ");
+    EXPECT_EQ(uris("unix sockets"), "/posts/2 ");
+
+    // Only json strings are text
+    EXPECT_EQ(uris("2024"), "/posts/3 ");
+    EXPECT_EQ(uris("false"), "");
+
+    Generator::RenderInfo info;
+    EXPECT_EQ(Generator::Generate(t, t.getRoot(), t.getRoot(), "home", nullptr, "/", &info),
+              "[a:FastCGI servers;b:Templates;|a:FastCGI servers;|a:FastCGI servers;|]");
+    EXPECT_TRUE(info.requestDependent);
+
+    // Snapshots keep the index
+    std::string snapshot = currentPath + "/testsnapshot";
+    EXPECT_TRUE(t.save(snapshot));
+    Tree mapped(currentPath + "/testtree");
+    EXPECT_TRUE(mapped.load(snapshot));
+    EXPECT_EQ(mapped.getSearchIndex().getDocumentCount(), 7);
+    EXPECT_EQ(mapped.getSearchIndex().getPostingCount(), t.getSearchIndex().getPostingCount());
+    mapped.search("nested epoll", 10, results);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0]->getUri(), "/b/c");
+
+    Tree unsearchable(currentPath + "/testtree");
+    unsearchable.setSearchable(false);
+    unsearchable.build();
+    EXPECT_EQ(unsearchable.getSearchIndex().getDocumentCount(), 0);
+    EXPECT_EQ(Generator::Generate(unsearchable, unsearchable.getRoot(), unsearchable.getRoot(), "home", nullptr, "/"),
+              "[|||]");
+
+    // Snapshots saved without an index are indexed when loaded
+    EXPECT_TRUE(unsearchable.save(snapshot));
+    Tree indexed(currentPath + "/testtree");
+    EXPECT_TRUE(indexed.load(snapshot));
+    EXPECT_EQ(indexed.getSearchIndex().getDocumentCount(), 7);
+
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove_all(currentPath + "/testtree");
+
+}